@@ -0,0 +1,153 @@
+#ifndef ADAPTIVEMUTEX_HPP
+#define ADAPTIVEMUTEX_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "spin.hpp"
+
+// #define LOCK_STATS // count contention per lock, or build with CPPFLAGS=-DLOCK_STATS
+// #define STD_LOCKS  // back the engine's lock sites with std::mutex again, or CPPFLAGS=-DSTD_LOCKS
+
+#ifdef LOCK_STATS
+#ifdef STD_LOCKS
+#error "LOCK_STATS counts AdaptiveMutex acquisitions and does not work with STD_LOCKS"
+#endif
+
+// Relaxed counters, so that several locks can count into one.
+struct LockStats {
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0}; // the first attempt failed
+    std::atomic<uint64_t> spun{0};      // contended, then acquired while spinning
+    std::atomic<uint64_t> parked{0};    // contended, then slept in the kernel
+};
+#endif
+
+/*
+ * Mutex for critical sections that are usually much shorter than a futex
+ * sleep/wake round trip.
+ *
+ * The lock word is 0 (free), 1 (held) or 2 (held, maybe with sleepers), as
+ * in Drepper's "Futexes Are Tricky", so an uncontended lock/unlock pair is
+ * one CAS and one atomic decrement and never enters the kernel. A
+ * contended lock() first spins with cpu_relax() for a bounded number of
+ * rounds and then parks on the futex. The spin bound adapts per lock: it
+ * follows how long past acquisitions had to spin and shrinks when spinning
+ * did not pay off, so a lock whose holders run long stops burning CPU.
+ * Spinning is disabled on single CPU machines.
+ *
+ * Satisfies Lockable, so it works with std::lock_guard and std::unique_lock,
+ * and may be unlocked by a different thread than the one that locked it.
+ */
+class AdaptiveMutex {
+public:
+    static constexpr uint32_t min_spin = 16;
+    static constexpr uint32_t max_spin = 512;
+
+    AdaptiveMutex() = default;
+
+    AdaptiveMutex(const AdaptiveMutex &) = delete;
+
+    AdaptiveMutex &operator=(const AdaptiveMutex &) = delete;
+
+    void lock() {
+        uint32_t c = 0;
+        if (!state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            lock_contended(c);
+        }
+#ifdef LOCK_STATS
+        count(&LockStats::acquisitions);
+#endif
+    }
+
+    bool try_lock() {
+        uint32_t c = 0;
+        if (!state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return false;
+        }
+#ifdef LOCK_STATS
+        count(&LockStats::acquisitions);
+#endif
+        return true;
+    }
+
+    void unlock() {
+        if (state.fetch_sub(1, std::memory_order_release) != 1) {
+            state.store(0, std::memory_order_release);
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        }
+    }
+
+#ifdef LOCK_STATS
+    // Counts into stats from now on instead of the lock's own counters, to
+    // report a group of locks together; call it before the lock is shared.
+    void count_into(LockStats &stats) {
+        counters = &stats;
+    }
+
+    const LockStats &stats() const {
+        return *counters;
+    }
+#endif
+
+private:
+    std::atomic<uint32_t> state{0};
+    std::atomic<uint16_t> spin_estimate{min_spin};
+#ifdef LOCK_STATS
+    LockStats own_counters;
+    LockStats *counters = &own_counters;
+
+    void count(std::atomic<uint64_t> LockStats::*counter) {
+        (counters->*counter).fetch_add(1, std::memory_order_relaxed);
+    }
+#endif
+
+    static bool spinning_useful() {
+        static const bool useful = std::thread::hardware_concurrency() > 1;
+        return useful;
+    }
+
+    void lock_contended(uint32_t c) {
+        uint32_t estimate = spin_estimate.load(std::memory_order_relaxed);
+        uint32_t limit = spinning_useful() ? std::min(max_spin, 2 * estimate + min_spin) : 0;
+
+        for (uint32_t spins = 0; spins < limit; ++spins) {
+            cpu_relax();
+            c = state.load(std::memory_order_relaxed);
+            if (c == 0 && state.compare_exchange_weak(c, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+                // moving average of the spins it took, like glibc's adaptive mutex
+                spin_estimate.store(static_cast<uint16_t>(estimate + (static_cast<int32_t>(spins) -
+                                                                      static_cast<int32_t>(estimate)) / 8),
+                                    std::memory_order_relaxed);
+#ifdef LOCK_STATS
+                count(&LockStats::contended);
+                count(&LockStats::spun);
+#endif
+                return;
+            }
+        }
+        if (limit > 0) {
+            spin_estimate.store(static_cast<uint16_t>(estimate / 2), std::memory_order_relaxed);
+        }
+
+        if (c != 2) {
+            c = state.exchange(2, std::memory_order_acquire);
+        }
+        while (c != 0) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state), FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+            c = state.exchange(2, std::memory_order_acquire);
+        }
+#ifdef LOCK_STATS
+        count(&LockStats::contended);
+        count(&LockStats::parked);
+#endif
+    }
+};
+
+#endif // ADAPTIVEMUTEX_HPP
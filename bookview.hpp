@@ -0,0 +1,186 @@
+#ifndef BOOKVIEW_HPP
+#define BOOKVIEW_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "adaptivemutex.hpp"
+#include "io.hpp"
+
+/*
+ * Read-only copy of one instrument's book for the query socket, rebuilt
+ * from the instrument's output rather than read from the books, so a query
+ * never touches a lock that matching takes.
+ *
+ * The instrument's Sequencer applies every block it writes, in output
+ * order and after the matching locks are released; the draining flag makes
+ * that one thread at a time. The writer keeps its own price levels and
+ * publishes an immutable snapshot of both sides after every block that
+ * changed them. Levels are copied on write, so a snapshot shares all the
+ * levels the block did not touch with the one before it. A block costs
+ * the writer a copy of each level it touched and one pointer per level.
+ * Readers copy the pointer to the latest snapshot, under a mutex that is
+ * held for nothing but that copy, and keep the snapshot as long as they
+ * like.
+ *
+ * Orders at one price are listed in output order, which can differ from
+ * their queue positions for orders that were added at the same time.
+ */
+class BookView {
+public:
+    struct Entry {
+        uint32_t id;
+        uint32_t count;
+        intmax_t timestamp;
+    };
+
+    struct Level {
+        uint32_t price;
+        uint64_t count;             // of all its orders
+        std::vector<Entry> orders;  // oldest first
+        uint64_t block;             // the block that copied it, writer only
+    };
+
+    struct Snapshot {
+        uint64_t version = 0; // blocks that changed the book so far
+        std::vector<std::shared_ptr<const Level>> buys;  // best price first
+        std::vector<std::shared_ptr<const Level>> sells; // best price first
+    };
+
+    BookView() : published{std::make_shared<const Snapshot>()} {}
+
+    BookView(const BookView &) = delete;
+
+    BookView &operator=(const BookView &) = delete;
+
+    std::shared_ptr<const Snapshot> snapshot() const {
+        std::lock_guard<AdaptiveMutex> guard(published_mutex);
+        return published;
+    }
+
+    // One block of output, never from two threads at once.
+    void apply(const OutputEvent *events, size_t n) {
+        const uint64_t block = version + 1;
+        bool changed = false;
+        for (size_t i = 0; i < n; ++i) {
+            const OutputEvent &e = events[i];
+            switch (e.kind) {
+                case OutputEvent::Added:
+                    changed |= add(block, e);
+                    break;
+                case OutputEvent::Executed:
+                    // an auction execution is between two resting orders
+                    changed |= reduce(block, e.id, e.count);
+                    changed |= reduce(block, e.other_id, e.count);
+                    break;
+                case OutputEvent::Reduced:
+                    changed |= reduce(block, e.id, e.count);
+                    break;
+                case OutputEvent::Deleted:
+                    changed |= e.flag && reduce(block, e.id, UINT32_MAX);
+                    break;
+                case OutputEvent::LevelSummary:
+                case OutputEvent::Rejected:
+                    break;
+            }
+        }
+        if (changed) {
+            version = block;
+            publish();
+        }
+    }
+
+private:
+    struct Located {
+        bool is_sell;
+        uint32_t price;
+    };
+
+    std::map<uint32_t, std::shared_ptr<Level>, std::greater<>> buys;
+    std::map<uint32_t, std::shared_ptr<Level>> sells;
+    std::unordered_map<uint32_t, Located> located;
+    uint64_t version = 0;
+    mutable AdaptiveMutex published_mutex;
+    std::shared_ptr<const Snapshot> published;
+
+    // The level at price, copied first if a published snapshot has it.
+    template<typename Levels>
+    static Level &writable(Levels &levels, uint32_t price, uint64_t block) {
+        auto &level = levels[price];
+        if (!level) {
+            level = std::make_shared<Level>(Level{price, 0, {}, block});
+        } else if (level->block != block) {
+            level = std::make_shared<Level>(*level);
+            level->block = block;
+        }
+        return *level;
+    }
+
+    bool add(uint64_t block, const OutputEvent &e) {
+        if (!located.try_emplace(e.id, Located{e.flag, e.price}).second) {
+            return false;
+        }
+        Level &level = e.flag ? writable(sells, e.price, block) : writable(buys, e.price, block);
+        level.orders.push_back({e.id, e.count, e.timestamp});
+        level.count += e.count;
+        return true;
+    }
+
+    bool reduce(uint64_t block, uint32_t id, uint32_t count) {
+        auto found = located.find(id);
+        if (found == located.end()) {
+            return false;
+        }
+        const Located where = found->second;
+        if (where.is_sell) {
+            reduce(sells, where, id, count, block);
+        } else {
+            reduce(buys, where, id, count, block);
+        }
+        return true;
+    }
+
+    template<typename Levels>
+    void reduce(Levels &levels, Located where, uint32_t id, uint32_t count, uint64_t block) {
+        Level &level = writable(levels, where.price, block);
+        auto entry = std::find_if(level.orders.begin(), level.orders.end(),
+                                  [id](const Entry &o) { return o.id == id; });
+        count = std::min(count, entry->count);
+        entry->count -= count;
+        level.count -= count;
+        if (entry->count > 0) {
+            return;
+        }
+        level.orders.erase(entry);
+        located.erase(id);
+        if (level.orders.empty()) {
+            levels.erase(where.price);
+        }
+    }
+
+    void publish() {
+        auto next = std::make_shared<Snapshot>();
+        next->version = version;
+        next->buys.reserve(buys.size());
+        for (const auto &[price, level]: buys) {
+            next->buys.push_back(level);
+        }
+        next->sells.reserve(sells.size());
+        for (const auto &[price, level]: sells) {
+            next->sells.push_back(level);
+        }
+        // swapped, so that the old snapshot is freed after the unlock
+        std::shared_ptr<const Snapshot> previous = std::move(next);
+        std::lock_guard<AdaptiveMutex> guard(published_mutex);
+        published.swap(previous);
+    }
+};
+
+#endif // BOOKVIEW_HPP
@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <getopt.h>
 #include <poll.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -13,10 +14,14 @@
 #include <atomic>
 
 #include "io.hpp"
+#include "shmring.hpp"
 
 #define INPUT_CANCEL_ORDER 'C'
 #define INPUT_BUY_ORDER 'B'
 #define INPUT_SELL_ORDER 'S'
+#define INPUT_MASS_CANCEL 'M'
+#define INPUT_TIME_TO_LIVE 'T'
+#define INPUT_ICEBERG 'I'
 
 static char* line_buffer;
 static size_t line_buffer_size = 0;
@@ -48,14 +53,50 @@ static void* poll_thread(void* fdptr)
 	return 0;
 }
 
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "Usage: %s [--shm[=spin|futex]] <path of socket to connect to> < <input>\n", argv0);
+}
+
 int main(int argc, char* argv[])
 {
-	if(argc < 2)
+	bool use_shm = false;
+	ShmWaitMode shm_mode = ShmWaitMode::Futex;
+
+	static const struct option long_options[] = {
+		{ "shm", optional_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	int opt;
+	while((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
 	{
-		fprintf(stderr, "Usage: %s <path of socket to connect to> < <input>\n", argv[0]);
+		switch(opt)
+		{
+			case 's':
+				use_shm = true;
+				if(optarg == NULL || strcmp(optarg, "futex") == 0)
+					shm_mode = ShmWaitMode::Futex;
+				else if(strcmp(optarg, "spin") == 0)
+					shm_mode = ShmWaitMode::Spin;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	if(optind >= argc)
+	{
+		usage(argv[0]);
 		return 1;
 	}
 
+	const char* socketpath = argv[optind];
+
 	int clientfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if(clientfd == -1)
 	{
@@ -66,7 +107,7 @@ int main(int argc, char* argv[])
 	{
 		struct sockaddr_un sockaddr {};
 		sockaddr.sun_family = AF_UNIX;
-		strncpy(sockaddr.sun_path, argv[1], sizeof(sockaddr.sun_path) - 1);
+		strncpy(sockaddr.sun_path, socketpath, sizeof(sockaddr.sun_path) - 1);
 		if(connect(clientfd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
 		{
 			perror("connect");
@@ -74,6 +115,10 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	ShmRing* ring = NULL;
+	if(use_shm && (ring = attach_shm_ring(clientfd, shm_mode)) == NULL)
+		return 1;
+
 	FILE* client = fdopen(clientfd, "r+");
 	setbuf(client, NULL);
 
@@ -104,6 +149,23 @@ int main(int argc, char* argv[])
 					return 1;
 				}
 				break;
+			case INPUT_MASS_CANCEL: input.type = input_mass_cancel; break;
+			case INPUT_TIME_TO_LIVE:
+				input.type = input_time_to_live;
+				if(sscanf(line_buffer + 1, " %u", &input.count) != 1)
+				{
+					fprintf(stderr, "Invalid time to live: %s\n", line_buffer);
+					return 1;
+				}
+				break;
+			case INPUT_ICEBERG:
+				input.type = input_iceberg;
+				if(sscanf(line_buffer + 1, " %u", &input.count) != 1)
+				{
+					fprintf(stderr, "Invalid display quantity: %s\n", line_buffer);
+					return 1;
+				}
+				break;
 			case INPUT_BUY_ORDER: input.type = input_buy; goto new_order;
 			case INPUT_SELL_ORDER:
 				input.type = input_sell;
@@ -117,6 +179,12 @@ int main(int argc, char* argv[])
 			default: fprintf(stderr, "Invalid command '%c'\n", line_buffer[0]); return 1;
 		}
 
+		if(ring != NULL)
+		{
+			ring->push(input);
+			continue;
+		}
+
 		if(fwrite(&input, 1, sizeof(input), client) != sizeof(input))
 		{
 			fprintf(stderr, "Failed to write command\n");
@@ -124,6 +192,9 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if(ring != NULL)
+		ring->close();
+
 	main_is_exiting = 1;
 	fclose(client);
 
@@ -0,0 +1,164 @@
+#ifndef DECODER_HPP
+#define DECODER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "io.hpp"
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "symbol keys assume little endian");
+
+/*
+ * Symbols are at most 8 characters, so a validated instrument name, zero
+ * padded, is its own 64-bit key: comparing or hashing one is a single
+ * integer operation and no std::string is built per command.
+ */
+typedef uint64_t SymbolKey;
+
+// Requires a command that went through decode_commands().
+inline SymbolKey symbol_key(const ClientCommand &command) {
+    SymbolKey key;
+    std::memcpy(&key, command.instrument, sizeof(key));
+    return key;
+}
+
+// Names longer than 8 characters are cut, like the client's %8s.
+inline SymbolKey symbol_key(std::string_view name) {
+    SymbolKey key = 0;
+    std::memcpy(&key, name.data(), std::min(name.size(), sizeof(key)));
+    return key;
+}
+
+inline void symbol_name(SymbolKey key, char (&out)[9]) {
+    std::memcpy(out, &key, sizeof(key));
+    out[8] = '\0';
+}
+
+inline std::string symbol_name(SymbolKey key) {
+    char name[9];
+    symbol_name(key, name);
+    return name;
+}
+
+// Zeroes everything after the instrument's terminator so the first 8 bytes
+// are its key. Returns false for an empty or unterminated name. SWAR: the
+// lowest zero byte is found with the has-zero-byte bit trick, no byte loop.
+inline bool normalize_symbol(char (&instrument)[9]) {
+    constexpr uint64_t ones = 0x0101010101010101ULL;
+    constexpr uint64_t highs = 0x8080808080808080ULL;
+
+    uint64_t word;
+    std::memcpy(&word, instrument, sizeof(word));
+    uint64_t zeros = (word - ones) & ~word & highs;
+    if (zeros == 0) {
+        return instrument[8] == '\0'; // exactly 8 characters
+    }
+
+    unsigned length = static_cast<unsigned>(__builtin_ctzll(zeros)) / 8;
+    if (length == 0) {
+        return false;
+    }
+    word &= (uint64_t{1} << (8 * length)) - 1;
+    std::memcpy(instrument, &word, sizeof(word));
+    instrument[8] = '\0';
+    return true;
+}
+
+/*
+ * Validates a buffer of commands straight off the wire and compacts the
+ * valid ones to its front, in order; returns how many there are. Valid are
+ * cancels, mass cancels, time to live and display settings, and buys/sells with a 1-8 character instrument and
+ * a price and count in [1, INT32_MAX]. The rest are dropped here and
+ * counted in rejected, so the engine never sees a malformed command.
+ *
+ * With SSE2 the type and range checks run on four commands at a time:
+ * prices and counts are positive int32 exactly when they are in range, so
+ * one signed compare per lane covers both bounds.
+ */
+inline size_t decode_commands(ClientCommand *commands, size_t n, size_t &rejected) {
+    size_t out = 0;
+    size_t i = 0;
+
+    auto keep = [&](size_t k) {
+        if (out != k) {
+            commands[out] = commands[k];
+        }
+        ++out;
+    };
+
+#ifdef __SSE2__
+    const __m128i buy = _mm_set1_epi32(input_buy);
+    const __m128i sell = _mm_set1_epi32(input_sell);
+    const __m128i cancel = _mm_set1_epi32(input_cancel);
+    const __m128i mass_cancel = _mm_set1_epi32(input_mass_cancel);
+    const __m128i time_to_live = _mm_set1_epi32(input_time_to_live);
+    const __m128i iceberg = _mm_set1_epi32(input_iceberg);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 4 <= n; i += 4) {
+        ClientCommand *c = commands + i;
+        __m128i type = _mm_setr_epi32(c[0].type, c[1].type, c[2].type, c[3].type);
+        __m128i price = _mm_setr_epi32(static_cast<int>(c[0].price), static_cast<int>(c[1].price),
+                                       static_cast<int>(c[2].price), static_cast<int>(c[3].price));
+        __m128i count = _mm_setr_epi32(static_cast<int>(c[0].count), static_cast<int>(c[1].count),
+                                       static_cast<int>(c[2].count), static_cast<int>(c[3].count));
+        __m128i symbol = _mm_setr_epi32(-normalize_symbol(c[0].instrument), -normalize_symbol(c[1].instrument),
+                                        -normalize_symbol(c[2].instrument), -normalize_symbol(c[3].instrument));
+
+        __m128i order = _mm_or_si128(_mm_cmpeq_epi32(type, buy), _mm_cmpeq_epi32(type, sell));
+        __m128i order_ok = _mm_and_si128(_mm_and_si128(order, symbol),
+                                         _mm_and_si128(_mm_cmpgt_epi32(price, zero), _mm_cmpgt_epi32(count, zero)));
+        __m128i other_ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(type, cancel), _mm_cmpeq_epi32(type, mass_cancel)),
+                                        _mm_or_si128(_mm_cmpeq_epi32(type, time_to_live), _mm_cmpeq_epi32(type, iceberg)));
+        __m128i ok = _mm_or_si128(order_ok, other_ok);
+
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(ok));
+        if (mask == 0xf && out == i) {
+            out += 4; // the common case: nothing to drop or move
+            continue;
+        }
+        for (size_t k = 0; k < 4; ++k) {
+            if (mask & (1 << k)) {
+                keep(i + k);
+            }
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        ClientCommand &c = commands[i];
+        bool ok;
+        switch (c.type) {
+            case input_buy:
+            case input_sell:
+                ok = normalize_symbol(c.instrument) && static_cast<int32_t>(c.price) > 0 &&
+                     static_cast<int32_t>(c.count) > 0;
+                break;
+            case input_cancel:
+            case input_mass_cancel:
+            case input_time_to_live:
+            case input_iceberg:
+                ok = true;
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        if (ok) {
+            keep(i);
+        }
+    }
+
+    rejected += n - out;
+    return out;
+}
+
+#endif // DECODER_HPP
@@ -1,31 +1,124 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <sstream>
 #include <thread>
 
 #include "engine.hpp"
 
+Engine::Engine(EngineConfig cfg)
+        : config{std::move(cfg)},
+          symbol_order_limit{order_limit(config.max_symbol_orders, config.max_symbol_bytes)},
+          session_order_limit{order_limit(config.max_session_orders, config.max_session_bytes)},
+          unknown_orders{"-", config.sequenced} {
+    preregister_symbols();
+    if (!auction_instruments.empty() && config.auction_interval_ms > 0) {
+        auction_thread = std::thread(&Engine::run_auctions, this);
+    }
+}
+
+Engine::~Engine() {
+    if (auction_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(auction_mutex);
+            auction_stopping = true;
+        }
+        auction_wakeup.notify_one();
+        auction_thread.join();
+    }
+    if (expiry_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(expiry_mutex);
+            expiry_stopping = true;
+        }
+        expiry_wakeup.notify_one();
+        expiry_thread.join();
+    }
+}
+
+// The tighter of the two limits, in orders.
+uint32_t Engine::order_limit(uint32_t orders, uint64_t bytes) {
+    uint64_t limit = orders > 0 ? orders : UINT32_MAX;
+    if (bytes > 0) {
+        limit = std::min<uint64_t>(limit, bytes / resting_order_bytes);
+    }
+    return static_cast<uint32_t>(limit);
+}
+
+// Two relaxed loads, so unlimited engines pay next to nothing for it.
+bool Engine::over_limit(Instrument &instrument, const Session &session) const {
+    return instrument.resting_orders.load(std::memory_order_relaxed) >= symbol_order_limit ||
+           session.resting_orders.load(std::memory_order_relaxed) >= session_order_limit;
+}
+
+void Engine::reject(Instrument &instrument, uint32_t id) {
+    instrument.rejected_orders.fetch_add(1, std::memory_order_relaxed);
+    EventBatch batch(instrument.sequencer, false);
+    batch.add({OutputEvent::Rejected, false, id, 0, 0, 0, 0, {}, getCurrentTimestamp()});
+}
+
+// Creates every configured symbol before any connection is accepted, so
+// the first orders of the day do not take the map's exclusive lock.
+void Engine::preregister_symbols() {
+    size_t expected_orders = 0;
+    instruments.reserve(config.symbols.size() + config.auction_symbols.size());
+    for (const auto &[symbol, depth]: config.symbols) {
+        SymbolKey key = symbol_key(symbol);
+        instruments.emplace(key, key, config.sequenced, config.book_views, forget_closed, depth);
+        expected_orders += 2 * static_cast<size_t>(depth);
+    }
+    if (expected_orders > 0) {
+        cancelable.reserve(expected_orders);
+    }
+
+    for (const auto &symbol: config.auction_symbols) {
+        SymbolKey key = symbol_key(symbol);
+        Instrument &instrument = instruments.emplace(key, key, config.sequenced, config.book_views, forget_closed);
+        if (!instrument.auction) {
+            instrument.auction = true;
+            auction_instruments.push_back(&instrument);
+        }
+    }
+}
+
+Instrument &Engine::instrument(SymbolKey symbol) {
+    return instruments.getOrEmplace(symbol, symbol, config.sequenced, config.book_views, forget_closed);
+}
+
 void Engine::accept(ClientConnection connection) {
-    auto thread = std::thread(&Engine::connection_thread, this, std::move(connection));
-    thread.detach();
+    auto session = open_session();
+    if (config.thread_per_connection) {
+        std::thread(&Engine::connection_thread, this, std::move(connection), session).detach();
+        return;
+    }
+
+    // only started once there are connections, so replay never pays for it
+    if (!executor) {
+        executor = std::make_unique<Executor>(config.workers);
+    }
+    executor->spawn(connection_task(std::move(connection), session));
 }
 
 #ifdef DEBUG
-void Engine::order_book_stat(const char* symbol)
+void Engine::order_book_stat(SymbolKey symbol)
 {
     SyncCerr {}
         << std::endl
-        << "DEBUG: " << symbol
+        << "DEBUG: " << symbol_name(symbol)
         << " ORDER BOOK STATUS" << std::endl;
    
+    auto &instrument = this->instrument(symbol);
+
     SyncCerr {}  << "BUY: " << std::endl;
 
-    for (const auto &o: buy_order_books[symbol]) {
-        SyncCerr {} << "  " << o;
+    for (auto it = instrument.buy_orders.begin(); it != instrument.buy_orders.end(); it = instrument.buy_orders.next(it)) {
+        SyncCerr {} << "  " << *it->order << std::endl;
     }
 
     SyncCerr {} << "SELL: " << std::endl;
 
-    for (const auto &o: sell_order_books[symbol]) {
-        SyncCerr {} << "  " << o;
+    for (auto it = instrument.sell_orders.begin(); it != instrument.sell_orders.end(); it = instrument.sell_orders.next(it)) {
+        SyncCerr {} << "  " << *it->order << std::endl;
     }
 
     SyncCerr {} << std::endl;
@@ -36,208 +129,883 @@ bool Engine::is_matching(const uint32_t &buy_price, const uint32_t &sell_price)
     return buy_price >= sell_price;
 }
 
-void Engine::buy(uint32_t id, const char *symbol, uint32_t price, uint32_t count) {
+void Engine::buy(const std::shared_ptr<Session> &session, uint32_t id, SymbolKey symbol, uint32_t price,
+                 uint32_t count) {
     bool is_order_fulfilled = false;
 
-    auto &s = mutexes.getOrDefault(symbol);
+    auto &instrument = this->instrument(symbol);
+    if (over_limit(instrument, *session)) {
+        reject(instrument, id);
+        return;
+    }
+    EventBatch batch(instrument.sequencer, config.level_summary);
+
+    auto &s = instrument.switches;
     s.buy_lightswitch.lock(s.shared_m);
 
-    auto &order_book = sell_order_books.getOrDefault(symbol);
+    auto &order_book = instrument.sell_orders;
     auto end_orderbook = order_book.end();
 
-    // match order
+    // match order; auction symbols only match in cross()
     for (auto current_order = order_book.begin();
          !is_order_fulfilled &&
+         !instrument.auction &&
          current_order != end_orderbook &&
          is_matching(price,
-                     (*current_order)->price);
+                     current_order->price);
          current_order = order_book.next(current_order)) {
-        is_order_fulfilled = process_matching_order(id, current_order, count);
+        is_order_fulfilled = process_matching_order(session->id, id, *current_order, true, count, batch);
     }
 
     // insert the unfulfilled order to buy order book
     if (!is_order_fulfilled) {
         auto ts = getCurrentTimestamp();
-        std::shared_ptr<Order> new_order = std::make_shared<Order>(price, ts, count, id);
-        insert_buy_order(symbol, new_order);
+        std::shared_ptr<Order> new_order = std::make_shared<Order>(price, ts, count, id, session,
+                                                                   instrument.auction ? 0 : session->order_display);
+#ifdef LOCK_STATS
+        new_order->order_mutex.count_into(instrument.order_locks);
+#endif
+        std::unique_lock<OrderMutex> new_order_lock(new_order->order_mutex);
+        insert_buy_order(instrument, new_order);
+        if (batch.full()) {
+            batch.publish();
+        }
+        batch.add(added_event(id, symbol, price, new_order->count, false, ts));
+        batch.hold(std::move(new_order_lock));
     }
 
     s.buy_lightswitch.unlock(s.shared_m);
+    batch.flush();
+
+    if (instrument.auction && config.auction_orders > 0 &&
+        instrument.orders_since_auction.fetch_add(1, std::memory_order_relaxed) + 1 == config.auction_orders) {
+        cross(instrument);
+    }
 
 #ifdef DEBUG
     order_book_stat(symbol);
 #endif
 }
 
-void Engine::insert_buy_order(const char *symbol, std::shared_ptr<Order> new_order) {
-    buy_order_books.getOrDefault(symbol).insert(new_order);
+void Engine::insert_buy_order(Instrument &instrument, std::shared_ptr<Order> new_order) {
+    new_order->instrument = &instrument;
+    instrument.resting_orders.fetch_add(1, std::memory_order_relaxed);
+    if (new_order->session) {
+        new_order->session->link(*new_order);
+    }
+    // only this side inserts into its own book right now, nobody iterates
+    // it, so filled and cancelled orders at the front can be dropped
+    instrument.buy_orders.erase_while_front(is_released);
+    new_order->sequence = instrument.buy_sequence.fetch_add(1, std::memory_order_relaxed);
+    instrument.buy_orders.insert({new_order->price, new_order->sequence, new_order});
     const uint32_t id = new_order->order_id;
     cancelable.put({id, new_order});
-
-    Output::OrderAdded(
-            id,
-            symbol,
-            new_order->price,
-            new_order->count,
-            false,
-            new_order->timestamp
-    );
+    if (new_order->session && new_order->session->order_ttl_ms > 0) {
+        schedule_expiry(new_order, new_order->session->order_ttl_ms);
+    }
 }
 
-void Engine::insert_sell_order(const char *symbol, std::shared_ptr<Order> new_order) {
-    sell_order_books.getOrDefault(symbol).insert(new_order);
+void Engine::insert_sell_order(Instrument &instrument, std::shared_ptr<Order> new_order) {
+    new_order->instrument = &instrument;
+    instrument.resting_orders.fetch_add(1, std::memory_order_relaxed);
+    if (new_order->session) {
+        new_order->session->link(*new_order);
+    }
+    // only this side inserts into its own book right now, nobody iterates
+    // it, so filled and cancelled orders at the front can be dropped
+    instrument.sell_orders.erase_while_front(is_released);
+    new_order->sequence = instrument.sell_sequence.fetch_add(1, std::memory_order_relaxed);
+    instrument.sell_orders.insert({new_order->price, new_order->sequence, new_order});
     const uint32_t id = new_order->order_id;
     cancelable.put({id, new_order});
-
-    Output::OrderAdded(
-            id,
-            symbol,
-            new_order->price,
-            new_order->count,
-            true,
-            new_order->timestamp
-    );
+    if (new_order->session && new_order->session->order_ttl_ms > 0) {
+        schedule_expiry(new_order, new_order->session->order_ttl_ms);
+    }
 }
 
-void Engine::sell(uint32_t id, const char *symbol, uint32_t price, uint32_t count) {
+void Engine::sell(const std::shared_ptr<Session> &session, uint32_t id, SymbolKey symbol, uint32_t price,
+                  uint32_t count) {
     bool is_order_fulfilled = false;
 
-    auto &s = mutexes.getOrDefault(symbol);
+    auto &instrument = this->instrument(symbol);
+    if (over_limit(instrument, *session)) {
+        reject(instrument, id);
+        return;
+    }
+    EventBatch batch(instrument.sequencer, config.level_summary);
+
+    auto &s = instrument.switches;
     s.sell_lightswitch.lock(s.shared_m);
 
-    auto &order_book = buy_order_books.getOrDefault(symbol);
+    auto &order_book = instrument.buy_orders;
     auto end_orderbook = order_book.end();
 
-    // match order
+    // match order; auction symbols only match in cross()
     for (auto current_order = order_book.begin();
          !is_order_fulfilled &&
+         !instrument.auction &&
          current_order != end_orderbook &&
-         is_matching((*current_order)->price, price);
+         is_matching(current_order->price, price);
          current_order = order_book.next(current_order)) {
-        is_order_fulfilled = process_matching_order(id, current_order, count);
+        is_order_fulfilled = process_matching_order(session->id, id, *current_order, false, count, batch);
     }
 
-    // insert the unfulfilled order to buy order book
+    // insert the unfulfilled order to sell order book
     if (!is_order_fulfilled) {
         auto ts = getCurrentTimestamp();
-        std::shared_ptr<Order> new_order = std::make_shared<Order>(price, ts, count, id);
-        insert_sell_order(symbol, new_order);
+        std::shared_ptr<Order> new_order = std::make_shared<Order>(price, ts, count, id, session,
+                                                                   instrument.auction ? 0 : session->order_display);
+#ifdef LOCK_STATS
+        new_order->order_mutex.count_into(instrument.order_locks);
+#endif
+        std::unique_lock<OrderMutex> new_order_lock(new_order->order_mutex);
+        insert_sell_order(instrument, new_order);
+        if (batch.full()) {
+            batch.publish();
+        }
+        batch.add(added_event(id, symbol, price, new_order->count, true, ts));
+        batch.hold(std::move(new_order_lock));
     }
 
     s.sell_lightswitch.unlock(s.shared_m);
+    batch.flush();
+
+    if (instrument.auction && config.auction_orders > 0 &&
+        instrument.orders_since_auction.fetch_add(1, std::memory_order_relaxed) + 1 == config.auction_orders) {
+        cross(instrument);
+    }
 
 #ifdef DEBUG
     order_book_stat(symbol);
 #endif
 }
 
-bool Engine::process_matching_order(uint32_t id, OrderBook_iterator current_order, uint32_t &count) {
-    std::lock_guard<std::mutex> lock((*current_order)->order_mutex);
+// Records the outcome in the batch and keeps the resting order locked
+// until the batch is published.
+bool Engine::process_matching_order(uint32_t session, uint32_t id, const BookEntry &resting, bool resting_is_sell,
+                                    uint32_t &count, EventBatch &batch) {
+    if (batch.full(2)) { // the execution and a replenished slice
+        batch.publish();
+    }
 
-    if ((*current_order)->count == 0) { // already cancelled
+    const std::shared_ptr<Order> &resting_order = resting.order;
+    std::unique_lock<OrderMutex> lock(resting_order->order_mutex);
+
+    // already cancelled, or the slice of an iceberg that was replenished since
+    if (resting_order->count == 0 || resting_order->sequence != resting.sequence) {
         return false;
     }
 
-    Output::OrderExecuted(
-            (*current_order)->order_id,
-            id,
-            (*current_order)->execution_id,
-            (*current_order)->price,
-            std::min((*current_order)->count, count),
-            getCurrentTimestamp()
-    );
-
-    if (count < (*current_order)->count) { // the order is fulfilled
-        (*current_order)->count -= count;
-        ((*current_order)->execution_id) += 1;
-        count = 0;
-        return true;
+    bool is_order_fulfilled;
+
+    // the owner is stored inline, so this costs a compare on the order we already hold
+    if (resting_order->session_id == session && config.stp != SelfTradePrevention::None) {
+        is_order_fulfilled = prevent_self_trade(id, *resting_order, count, batch);
     } else {
-        count -= (*current_order)->count;
-        (*current_order)->count = 0;
-        return count == 0;
+        uint32_t executed = std::min(resting_order->count, count);
+        batch.add({OutputEvent::Executed, false, resting_order->order_id, id, resting_order->execution_id,
+                   resting_order->price, executed, {}, getCurrentTimestamp()});
+
+        if (count < resting_order->count) { // the order is fulfilled
+            resting_order->count -= count;
+            (resting_order->execution_id) += 1;
+            count = 0;
+            is_order_fulfilled = true;
+        } else {
+            count -= resting_order->count;
+            if (!replenish(resting_order, resting_is_sell, batch)) {
+                release_order(*resting_order, batch.closed_orders());
+            }
+            is_order_fulfilled = count == 0;
+        }
+    }
+
+    batch.hold(std::move(lock));
+    if (resting_order->sequence != resting.sequence) {
+        // The sweep may reach the new slice and must not find it locked by
+        // itself; nor may it keep the lock while taking the ones in between,
+        // out of book order, where another sweep could hold them. This only
+        // releases the lock and stages the events, the side lock is still
+        // held, so the output waits for the flush after the sweep.
+        batch.publish();
+    }
+    return is_order_fulfilled;
+}
+
+/*
+ * Called with the order's mutex held once its displayed quantity is gone.
+ * An iceberg with reserve left shows its next slice, behind the orders
+ * already at its price: the same Order goes back into the book under a new
+ * BookEntry sequence, which leaves the old entry dead, and is reported
+ * added again with the slice. Returns false for an order that is done.
+ */
+bool Engine::replenish(const std::shared_ptr<Order> &order, bool is_sell, EventBatch &batch) {
+    if (order->reserve == 0) {
+        return false;
+    }
+    Instrument &instrument = *order->instrument;
+    order->count = std::min(order->display, order->reserve);
+    order->reserve -= order->count;
+    order->execution_id += 1;
+    order->timestamp = getCurrentTimestamp();
+    // the other side is sweeping this book and nobody erases from it meanwhile
+    if (is_sell) {
+        order->sequence = instrument.sell_sequence.fetch_add(1, std::memory_order_relaxed);
+        instrument.sell_orders.insert({order->price, order->sequence, order});
+    } else {
+        order->sequence = instrument.buy_sequence.fetch_add(1, std::memory_order_relaxed);
+        instrument.buy_orders.insert({order->price, order->sequence, order});
+    }
+    batch.add(added_event(order->order_id, instrument.symbol, order->price, order->count, is_sell, order->timestamp));
+    return true;
+}
+
+// Called with the order's mutex held once its remaining quantity is gone,
+// exactly once per booked order, with the closed orders of the batch that
+// reports it. A book may keep the Order until it prunes the entry, but not
+// its session.
+void Engine::release_order(Order &order, std::vector<std::shared_ptr<Order>> &closed) {
+    order.count = 0;
+    order.instrument->resting_orders.fetch_sub(1, std::memory_order_relaxed);
+    if (order.expires) {
+        cancel_expiry(order);
     }
+    if (order.session) {
+        order.session->unlink(order);
+        order.session.reset();
+    }
+    closed.push_back(order.shared_from_this());
+}
+
+// Called by the order's sequencer once the output that closed it is
+// written, so a cancel that no longer finds the id, and is answered as for
+// an unknown order, cannot be written ahead of it.
+void Engine::forget(const std::shared_ptr<Order> &order) {
+    // a reused id may already belong to a newer order
+    cancelable.erase_if(order->order_id, [&](const std::shared_ptr<Order> &entry) { return entry == order; });
+}
+
+// Never blocks: an order somebody else holds is treated as still open. The
+// entries a replenished iceberg left behind are released.
+bool Engine::is_released(const BookEntry &entry) {
+    std::unique_lock<OrderMutex> lock(entry.order->order_mutex, std::try_to_lock);
+    return lock.owns_lock() && (entry.order->count == 0 || entry.order->sequence != entry.sequence);
+}
+
+OutputEvent Engine::added_event(uint32_t id, SymbolKey symbol, uint32_t price, uint32_t count, bool is_sell_side,
+                                intmax_t timestamp) {
+    OutputEvent event{OutputEvent::Added, is_sell_side, id, 0, 0, price, count, {}, timestamp};
+    symbol_name(symbol, event.symbol);
+    return event;
+}
+
+OutputEvent Engine::deleted_event(uint32_t id, bool accepted) {
+    return {OutputEvent::Deleted, accepted, id, 0, 0, 0, 0, {}, getCurrentTimestamp()};
+}
+
+// Called with the resting order's mutex held. A cancelled resting order is
+// reported as an accepted delete, the cancelled remainder of the incoming
+// order, which was never added, as rejected. A decrement is reported as
+// 'D <resting id> <incoming id> <count> <time>' and closes whichever
+// order it takes to zero, like an execution would. The displayed slice of
+// an iceberg counts as the order: decrementing it away drops the reserve.
+bool Engine::prevent_self_trade(uint32_t id, Order &resting_order, uint32_t &count, EventBatch &batch) {
+    switch (config.stp) {
+        case SelfTradePrevention::CancelResting:
+            release_order(resting_order, batch.closed_orders());
+            batch.add(deleted_event(resting_order.order_id, true));
+            return false;
+
+        case SelfTradePrevention::CancelIncoming:
+            count = 0;
+            batch.add({OutputEvent::Rejected, false, id, 0, 0, 0, 0, {}, getCurrentTimestamp()});
+            return true;
+
+        case SelfTradePrevention::DecrementBoth: {
+            uint32_t overlap = std::min(resting_order.count, count);
+            resting_order.count -= overlap;
+            count -= overlap;
+            batch.add({OutputEvent::Reduced, false, resting_order.order_id, id, 0, resting_order.price, overlap, {},
+                       getCurrentTimestamp()});
+            if (resting_order.count == 0) {
+                release_order(resting_order, batch.closed_orders());
+            }
+            return count == 0;
+        }
+
+        case SelfTradePrevention::None:
+            break;
+    }
+    return false;
 }
 
 void Engine::cancel(uint32_t id) {
-    if (!cancelable.contains(id)) {
-        Output::OrderDeleted(
-                id,
-                false,
-                getCurrentTimestamp()
-        );
+    std::optional<std::shared_ptr<Order>> found = cancelable.get(id);
+    if (!found) {
+        EventBatch batch(unknown_orders, false);
+        batch.add(deleted_event(id, false));
         return;
     }
 
-    auto order = cancelable.getOrDefault(id);
-    std::lock_guard<std::mutex> guard(order->order_mutex);
+    std::shared_ptr<Order> order = std::move(*found);
+    std::unique_lock<OrderMutex> lock(order->order_mutex);
+    EventBatch batch(order->instrument->sequencer, false);
+
+    // a reject here still has to follow the fill that closed the order
+    const bool accepted = order->count > 0;
+    if (accepted) {
+        release_order(*order, batch.closed_orders());
+    }
+    batch.add(deleted_event(id, accepted));
+    batch.hold(std::move(lock));
+}
 
-    if (order->count == 0) {
-        Output::OrderDeleted(
-                id,
-                false,
-                getCurrentTimestamp()
-        );
+// Cancels every open order of the session, the deletes of each instrument
+// collected in one batch and written as one block.
+void Engine::cancel_session_orders(Session &session) {
+    std::vector<std::shared_ptr<Order>> orders = session.open_orders_snapshot();
+    cancel_orders(orders);
+}
+
+// Called with the new order's mutex held, before anyone else can release it.
+void Engine::schedule_expiry(const std::shared_ptr<Order> &order, uint32_t ttl_ms) {
+    std::call_once(expiry_started, [this] { expiry_thread = std::thread(&Engine::run_expiry, this); });
+
+    auto now = std::chrono::steady_clock::now() - expiry_epoch;
+    uint64_t deadline = std::chrono::duration_cast<std::chrono::milliseconds>(now).count() + ttl_ms;
+
+    bool was_idle;
+    {
+        std::lock_guard<std::mutex> guard(expiry_mutex);
+        was_idle = expiries.size() == 0;
+        order->expires = true;
+        order->expiry = expiries.schedule(order, deadline);
+    }
+    if (was_idle) {
+        expiry_wakeup.notify_one();
+    }
+}
+
+// Called with the order's mutex held. A timer that already fired is gone,
+// the expiry thread then finds the order released and skips it.
+void Engine::cancel_expiry(Order &order) {
+    std::lock_guard<std::mutex> guard(expiry_mutex);
+    if (order.expiry != nullptr) {
+        expiries.cancel(order.expiry);
+        order.expiry = nullptr;
+    }
+}
+
+// Ticks the wheel once a millisecond while it holds timers and sleeps
+// otherwise. Due orders are collected under expiry_mutex and cancelled
+// after it is released.
+void Engine::run_expiry() {
+    std::vector<std::shared_ptr<Order>> expired;
+    std::unique_lock<std::mutex> lock(expiry_mutex);
+    while (!expiry_stopping) {
+        if (expiries.size() == 0) {
+            expiry_wakeup.wait(lock);
+            continue;
+        }
+        expiry_wakeup.wait_for(lock, std::chrono::milliseconds(1));
+
+        auto now = std::chrono::steady_clock::now() - expiry_epoch;
+        expiries.advance(std::chrono::duration_cast<std::chrono::milliseconds>(now).count(),
+                         [&](std::shared_ptr<Order> order) {
+                             order->expiry = nullptr;
+                             expired.push_back(std::move(order));
+                         });
+        if (expired.empty()) {
+            continue;
+        }
+
+        lock.unlock();
+        cancel_orders(expired);
+        expired.clear();
+        lock.lock();
+    }
+}
+
+/*
+ * Cancels the orders that are still open, due ones or a whole session's,
+ * one symbol at a time. The symbol's side lock is taken once for all of
+ * them, which keeps every sweep off the symbol, so holding several order
+ * locks at once cannot deadlock with a sweep taking them in book order.
+ * Each symbol's deletes take one sequence number per batch and are flushed
+ * once, and with both sides quiet the released orders at the front of the
+ * books are dropped right away.
+ */
+void Engine::cancel_orders(std::vector<std::shared_ptr<Order>> &orders) {
+    std::stable_sort(orders.begin(), orders.end(),
+                     [](const std::shared_ptr<Order> &a, const std::shared_ptr<Order> &b) {
+                         return a->instrument < b->instrument;
+                     });
+
+    for (auto first = orders.begin(); first != orders.end();) {
+        Instrument &instrument = *(*first)->instrument;
+        auto last = std::find_if(first, orders.end(), [&](const std::shared_ptr<Order> &order) {
+            return order->instrument != &instrument;
+        });
+
+        EventBatch batch(instrument.sequencer, false);
+        {
+            std::lock_guard<SideMutex> both_sides(instrument.switches.shared_m);
+            for (auto it = first; it != last; ++it) {
+                if (batch.full()) {
+                    batch.publish();
+                }
+                Order &order = **it;
+                std::unique_lock<OrderMutex> lock(order.order_mutex);
+                if (order.count > 0) { // not filled or cancelled in the meantime
+                    release_order(order, batch.closed_orders());
+                    batch.add(deleted_event(order.order_id, true));
+                }
+                batch.hold(std::move(lock));
+            }
+            batch.publish();
+            instrument.buy_orders.erase_while_front(is_released);
+            instrument.sell_orders.erase_while_front(is_released);
+        }
+        batch.flush();
+        first = last;
+    }
+}
+
+void Engine::run_auctions() {
+    std::unique_lock<std::mutex> lock(auction_mutex);
+    while (!auction_stopping) {
+        auction_wakeup.wait_for(lock, std::chrono::milliseconds(config.auction_interval_ms));
+        if (auction_stopping) {
+            break;
+        }
+        lock.unlock();
+        for (Instrument *instrument: auction_instruments) {
+            cross(*instrument);
+        }
+        lock.lock();
+    }
+}
+
+/*
+ * Uncrosses an auction symbol's book at a single price. The symbol's side
+ * lock is the only book lock taken: with it held no sweep or insert runs,
+ * so the crossing orders can all be locked at once, the way expiry does.
+ *
+ * The clearing price is the price of a crossing order that maximizes the
+ * executed volume min(demand, supply), then minimizes the surplus left on
+ * one side, then is the lowest. Orders execute in price-time priority, the
+ * earlier booked order of a pair reported as the resting one, and all
+ * executions of the auction are written as one block.
+ */
+void Engine::cross(Instrument &instrument) {
+    struct Crossing {
+        Order *order;
+        uint32_t price;
+    };
+    std::vector<Crossing> buys;
+    std::vector<Crossing> sells;
+    std::vector<std::unique_lock<OrderMutex>> locks;
+
+    std::unique_lock<SideMutex> both_sides(instrument.switches.shared_m);
+    instrument.orders_since_auction.store(0, std::memory_order_relaxed);
+
+    // locks and collects the open orders of a side in priority order, for as long as they cross
+    auto collect = [&](auto &book, std::vector<Crossing> &side, auto crosses) {
+        for (auto it = book.begin(); it != book.end() && crosses(it->price); it = book.next(it)) {
+            std::unique_lock<OrderMutex> lock(it->order->order_mutex);
+            if (it->order->count > 0) {
+                side.push_back({it->order.get(), it->price});
+                locks.push_back(std::move(lock));
+            }
+        }
+    };
+    // the best order of each side first, which bounds the rest
+    collect(instrument.buy_orders, buys, [&](uint32_t) { return buys.empty(); });
+    collect(instrument.sell_orders, sells, [&](uint32_t) { return sells.empty(); });
+    if (buys.empty() || sells.empty() || buys[0].price < sells[0].price) {
+        return;
+    }
+    const uint32_t best_buy = buys[0].price;
+    const uint32_t best_sell = sells[0].price;
+    buys.clear();
+    sells.clear();
+    locks.clear();
+    collect(instrument.buy_orders, buys, [&](uint32_t p) { return p >= best_sell; });
+    collect(instrument.sell_orders, sells, [&](uint32_t p) { return p <= best_buy; });
+
+    // demand at p: buys priced at least p; supply at p: sells priced at most p
+    std::vector<uint32_t> prices;
+    for (const auto &c: buys) {
+        prices.push_back(c.price);
+    }
+    for (const auto &c: sells) {
+        prices.push_back(c.price);
+    }
+    std::sort(prices.begin(), prices.end());
+    prices.erase(std::unique(prices.begin(), prices.end()), prices.end());
+
+    uint64_t demand = 0;
+    for (const auto &c: buys) {
+        demand += c.order->count;
+    }
+    uint64_t supply = 0;
+    uint64_t best_volume = 0;
+    uint64_t best_surplus = 0;
+    uint32_t clearing = 0;
+    size_t next_buy = buys.size(); // buys are sorted high to low, walked from the low end
+    size_t next_sell = 0;
+    for (uint32_t p: prices) {
+        for (; next_buy > 0 && buys[next_buy - 1].price < p; --next_buy) {
+            demand -= buys[next_buy - 1].order->count;
+        }
+        for (; next_sell < sells.size() && sells[next_sell].price <= p; ++next_sell) {
+            supply += sells[next_sell].order->count;
+        }
+        uint64_t volume = std::min(demand, supply);
+        uint64_t surplus = std::max(demand, supply) - volume;
+        if (volume > best_volume || (volume == best_volume && volume > 0 && surplus < best_surplus)) {
+            best_volume = volume;
+            best_surplus = surplus;
+            clearing = p;
+        }
+    }
+    if (best_volume == 0) {
         return;
     }
 
-    order->count = 0;
-    Output::OrderDeleted(
-            id,
-            true,
-            getCurrentTimestamp()
-    );
+    std::vector<OutputEvent> events;
+    std::vector<std::shared_ptr<Order>> closed;
+    size_t b = 0;
+    size_t s = 0;
+    while (b < buys.size() && s < sells.size() && buys[b].price >= clearing && sells[s].price <= clearing) {
+        Order &buy = *buys[b].order;
+        Order &sell = *sells[s].order;
+        Order &resting = buy.timestamp <= sell.timestamp ? buy : sell;
+        Order &incoming = &resting == &buy ? sell : buy;
+        uint32_t executed = std::min(buy.count, sell.count);
+        events.push_back({OutputEvent::Executed, false, resting.order_id, incoming.order_id, resting.execution_id,
+                          clearing, executed, {}, getCurrentTimestamp()});
+        resting.execution_id += 1;
+
+        for (Order *order: {&buy, &sell}) {
+            order->count -= executed;
+            if (order->count == 0) {
+                release_order(*order, closed);
+            }
+        }
+        b += buy.count == 0;
+        s += sell.count == 0;
+    }
 
-#ifdef DEBUG
-    order_book_stat(symbol.c_str());
-#endif
+    const uint64_t seq = instrument.sequencer.next();
+    locks.clear();
+    instrument.sequencer.stage(seq, events.data(), events.size(), &closed);
 
+    // the fully filled orders are at the front of the books now
+    instrument.buy_orders.erase_while_front(is_released);
+    instrument.sell_orders.erase_while_front(is_released);
+    both_sides.unlock();
+    instrument.sequencer.drain(seq);
 }
 
-void Engine::connection_thread(ClientConnection connection) {
+// Blocking loop on a thread of its own, for --thread-per-connection and
+// for shm ring sessions, whose ring cannot be waited on with epoll. The
+// rate limit applies; sharing the CPUs is left to the OS scheduler.
+void Engine::connection_thread(ClientConnection connection, std::shared_ptr<Session> session) {
+    CommandBatch batch;
+    std::optional<TokenBucket> bucket = session_bucket();
+
     while (true) {
-        ClientCommand input{};
-        switch (connection.readInput(input)) {
+        uint32_t allowed = admit(*session, bucket, CommandBatch::capacity);
+        if (allowed == 0) {
+            std::this_thread::sleep_for(bucket->wait(CommandBatch::capacity));
+            continue;
+        }
+
+        switch (connection.readCommands(batch, true, allowed)) {
             case ReadResult::Error:
                 SyncCerr{} << "Error reading input" << std::endl;
+                [[fallthrough]];
             case ReadResult::EndOfFile:
+                close_session(*session);
                 return;
             case ReadResult::Success:
+            case ReadResult::WouldBlock:
                 break;
         }
 
-        // Functions for printing output actions in the prescribed format are
-        // provided in the Output class:
-        switch (input.type) {
-            case input_cancel: {
-                cancel(input.order_id);
-                break;
-            }
+        if (bucket) {
+            bucket->take(batch.size + batch.rejected);
+        }
+        handle_batch(session, batch);
+    }
+}
 
-            case input_buy: {
-                buy(input.order_id, input.instrument, input.price, input.count);
-                break;
-            }
+// The batch is only used between two suspensions, so every worker thread
+// lends the same one to whichever session it is running. Not inlined so the
+// thread_local is looked up again after the coroutine moved threads.
+__attribute__((noinline)) static CommandBatch &worker_batch() {
+    thread_local CommandBatch batch;
+    return batch;
+}
 
-            case input_sell: {
-                sell(input.order_id, input.instrument, input.price, input.count);
-                break;
-            }
+// Same as connection_thread, but suspends on the executor instead of
+// blocking while the client has nothing to say, and takes turns with the
+// other sessions. A turn reads no more than the session's deficit allows,
+// at most one batch, and ends with a yield. A turn that cost more than
+// the deficit, by a mass cancel, leaves a debt that later quanta pay off
+// first; credit is never carried over.
+Task Engine::connection_task(ClientConnection connection, std::shared_ptr<Session> session) {
+    std::optional<TokenBucket> bucket = session_bucket();
+    const int64_t quantum = std::max(config.session_quantum, 1u);
+    int64_t deficit = 0;
 
-            default: {
-                SyncCerr{}
-                        << "Got order: " << static_cast<char>(input.type) << " " << input.instrument << " x "
-                        << input.count << " @ "
-                        << input.price << " ID: " << input.order_id << std::endl;
+    while (true) {
+        deficit += quantum;
+        if (deficit <= 0) {
+            co_await executor->yield();
+            continue;
+        }
 
-                // Remember to take timestamp at the appropriate time, or compute
-                // an appropriate timestamp!
-                auto output_time = getCurrentTimestamp();
+        uint32_t wanted = static_cast<uint32_t>(std::min<int64_t>(deficit, CommandBatch::capacity));
+        uint32_t allowed = admit(*session, bucket, wanted);
+        if (allowed == 0) {
+            deficit -= quantum; // waiting is not a turn
+            co_await executor->sleep_for(bucket->wait(wanted));
+            continue;
+        }
 
-                Output::OrderAdded(input.order_id, input.instrument, input.price, input.count, input.type == input_sell,
-                                   output_time);
+        CommandBatch &batch = worker_batch();
+        switch (connection.readCommands(batch, false, allowed)) {
+            case ReadResult::Error:
+                SyncCerr{} << "Error reading input" << std::endl;
+                [[fallthrough]];
+            case ReadResult::EndOfFile:
+                close_session(*session);
+                co_return;
+            case ReadResult::WouldBlock:
+                deficit = 0;
+                co_await executor->ready(connection.handle(), EPOLLIN);
+                continue;
+            case ReadResult::Success:
                 break;
+        }
+
+        if (connection.usesRing()) {
+            std::thread(&Engine::connection_thread, this, std::move(connection), std::move(session)).detach();
+            co_return;
+        }
+
+        const uint32_t read = batch.size + batch.rejected;
+        if (bucket) {
+            bucket->take(read);
+        }
+        deficit = std::min<int64_t>(deficit - handle_batch(session, batch), 0);
+        if (read == wanted) {
+            session->deferred.fetch_add(1, std::memory_order_relaxed);
+            deferred_turns.fetch_add(1, std::memory_order_relaxed);
+        }
+        co_await executor->yield();
+    }
+}
+
+uint64_t Engine::handle_batch(const std::shared_ptr<Session> &session, CommandBatch &batch) {
+    if (batch.rejected > 0) {
+        SyncCerr{} << "Session " << session->id << ": rejected " << batch.rejected << " malformed commands"
+                   << std::endl;
+        batch.rejected = 0;
+    }
+
+    uint64_t cost = batch.size;
+    for (size_t i = 0; i < batch.size; ++i) {
+        if (batch.commands[i].type == input_mass_cancel) {
+            cost += session->resting_orders.load(std::memory_order_relaxed);
+        }
+        handle(session, batch.commands[i]);
+    }
+    return cost;
+}
+
+std::optional<TokenBucket> Engine::session_bucket() const {
+    if (config.session_rate == 0) {
+        return std::nullopt;
+    }
+    uint32_t burst = config.session_burst != 0 ? config.session_burst : config.session_rate / 10;
+    return TokenBucket(config.session_rate, burst);
+}
+
+uint32_t Engine::admit(Session &session, std::optional<TokenBucket> &bucket, uint32_t wanted) {
+    if (!bucket) {
+        return wanted;
+    }
+    uint32_t allowed = bucket->available(wanted, TokenBucket::Clock::now());
+    if (allowed == 0) {
+        session.throttled.fetch_add(1, std::memory_order_relaxed);
+        throttled_turns.fetch_add(1, std::memory_order_relaxed);
+    }
+    return allowed;
+}
+
+std::shared_ptr<Session> Engine::open_session() {
+    auto session = std::make_shared<Session>(next_session_id.fetch_add(1, std::memory_order_relaxed));
+    sessions.put({session->id, session});
+    return session;
+}
+
+void Engine::close_session(Session &session) {
+    if (config.cancel_on_disconnect) {
+        cancel_session_orders(session);
+    }
+    sessions.erase(session.id);
+}
+
+// Counters are read without stopping the engine, so a report can be off by
+// the orders in flight. Closed orders the books have not pruned yet keep
+// their Order and book node, without their session, and are in no count.
+void Engine::report_metrics() {
+    uint64_t open = 0;
+    std::ostringstream report;
+
+    instruments.for_each([&](SymbolKey symbol, Instrument &instrument) {
+        uint32_t resting = instrument.resting_orders.load(std::memory_order_relaxed);
+        open += resting;
+        report << "metrics symbol " << symbol_name(symbol) << " resting_orders " << resting
+               << " resting_bytes " << resting * resting_order_bytes
+               << " rejected_orders " << instrument.rejected_orders.load(std::memory_order_relaxed) << '\n';
+#ifdef LOCK_STATS
+        report << "metrics locks " << symbol_name(symbol);
+        for (auto [name, stats]: {std::pair<const char *, const LockStats *>{"order", &instrument.order_locks},
+                                  {"side", &instrument.side_lock},
+                                  {"switch", &instrument.switch_locks}}) {
+            report << ' ' << name << "_acquired " << stats->acquisitions.load(std::memory_order_relaxed)
+                   << ' ' << name << "_contended " << stats->contended.load(std::memory_order_relaxed)
+                   << ' ' << name << "_spun " << stats->spun.load(std::memory_order_relaxed)
+                   << ' ' << name << "_parked " << stats->parked.load(std::memory_order_relaxed);
+        }
+        report << '\n';
+#endif
+    });
+    sessions.for_each([&](uint32_t id, const std::weak_ptr<Session> &weak) {
+        if (auto session = weak.lock()) {
+            uint32_t resting = session->resting_orders.load(std::memory_order_relaxed);
+            report << "metrics session " << id << " resting_orders " << resting
+                   << " resting_bytes " << resting * resting_order_bytes
+                   << " throttled " << session->throttled.load(std::memory_order_relaxed)
+                   << " deferred " << session->deferred.load(std::memory_order_relaxed) << '\n';
+        }
+    });
+    uint64_t tracked = cancelable.size();
+    report << "metrics engine resting_orders " << open << " tracked_orders " << tracked
+           << " tracked_bytes " << tracked * resting_order_bytes
+           << " throttled " << throttled_turns.load(std::memory_order_relaxed)
+           << " deferred " << deferred_turns.load(std::memory_order_relaxed) << '\n';
+
+    SyncCerr{} << report.str() << std::flush;
+}
+
+std::string Engine::query(const std::string &request) {
+    std::istringstream in(request);
+    std::string command, name;
+    if (!(in >> command >> name) || name.size() > 8) {
+        return "error usage: top <symbol> [<levels>] | depth <symbol> | order <symbol> <id>\n";
+    }
+    if (!config.book_views) {
+        return "error book views are off\n";
+    }
+    Instrument *instrument = instruments.find(symbol_key(name));
+    if (instrument == nullptr) {
+        return "error unknown symbol " + name + "\n";
+    }
+
+    const auto book = instrument->view->snapshot();
+    std::ostringstream out;
+    if (command == "top") {
+        size_t levels = 5;
+        if (uint32_t n; in >> n) {
+            levels = n;
+        }
+        auto top = [&](char side, const auto &book_side) {
+            for (size_t i = 0; i < std::min(levels, book_side.size()); ++i) {
+                const BookView::Level &level = *book_side[i];
+                out << side << ' ' << level.price << ' ' << level.count << ' ' << level.orders.size() << '\n';
+            }
+        };
+        top('B', book->buys);
+        top('S', book->sells);
+    } else if (command == "depth") {
+        auto depth = [&](char side, const auto &book_side) {
+            for (const auto &level: book_side) {
+                for (const BookView::Entry &o: level->orders) {
+                    out << side << ' ' << level->price << ' ' << o.id << ' ' << o.count << ' ' << o.timestamp << '\n';
+                }
             }
+        };
+        depth('B', book->buys);
+        depth('S', book->sells);
+    } else if (command == "order") {
+        uint32_t id;
+        if (!(in >> id)) {
+            return "error usage: order <symbol> <id>\n";
         }
+        auto find = [&](char side, const auto &book_side) {
+            for (const auto &level: book_side) {
+                for (size_t i = 0; i < level->orders.size(); ++i) {
+                    const BookView::Entry &o = level->orders[i];
+                    if (o.id == id) {
+                        out << side << ' ' << level->price << ' ' << o.id << ' ' << o.count << ' ' << o.timestamp
+                            << ' ' << i + 1 << '\n';
+                        return true;
+                    }
+                }
+            }
+            return false;
+        };
+        if (!find('B', book->buys)) {
+            find('S', book->sells);
+        }
+    } else {
+        return "error unknown query " + command + "\n";
     }
+    out << "end " << book->version << '\n';
+    return out.str();
 }
+
+void Engine::handle(const std::shared_ptr<Session> &session, const ClientCommand &input) {
+    switch (input.type) {
+        case input_cancel: {
+            cancel(input.order_id);
+            break;
+        }
+
+        case input_mass_cancel: {
+            cancel_session_orders(*session);
+            break;
+        }
+
+        case input_time_to_live: {
+            session->order_ttl_ms = input.count;
+            break;
+        }
+
+        case input_iceberg: {
+            session->order_display = input.count;
+            break;
+        }
+
+        case input_buy: {
+            buy(session, input.order_id, symbol_key(input), input.price, input.count);
+            break;
+        }
+
+        case input_sell: {
+            sell(session, input.order_id, symbol_key(input), input.price, input.count);
+            break;
+        }
+
+        default: {
+            // decode_commands() keeps these from ever getting here
+            SyncCerr{} << "Ignoring command of unknown type " << static_cast<int>(input.type) << std::endl;
+            break;
+        }
+    }
+}
\ No newline at end of file
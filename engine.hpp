@@ -4,63 +4,339 @@
 #ifndef ENGINE_HPP
 #define ENGINE_HPP
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <unordered_map>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "decoder.hpp"
 #include "io.hpp"
 #include "order.hpp"
 #include "safemap.hpp"
 #include "safeset.hpp"
+#include "skiplist.hpp"
 #include "lightswitch.hpp"
+#include "session.hpp"
+#include "sequencer.hpp"
+#include "eventbatch.hpp"
+#include "executor.hpp"
+#include "tokenbucket.hpp"
 
 // #define DEBUG
+// #define SKIPLIST_BOOK // lock-free skip list books instead of SafeSet, or build with CPPFLAGS=-DSKIPLIST_BOOK
 typedef SafeMap<uint32_t, std::shared_ptr<Order>> CancelMap;
-typedef SafeMap<std::string, LightSwitches> MutexMap;
-typedef SafeSet<std::shared_ptr<Order>, buy_cmp> SingleBuyOrderBook;
-typedef SafeSet<std::shared_ptr<Order>, sell_cmp> SingleSellOrderBook;
-typedef SafeMap<std::string, SingleBuyOrderBook> MultipleBuyOrderBooks;
-typedef SafeMap<std::string, SingleSellOrderBook> MultipleSellOrderBooks;
-typedef std::set<std::shared_ptr<Order>, buy_cmp>::const_iterator OrderBook_iterator; // Iterators for sell and buy are the same
+#ifdef SKIPLIST_BOOK
+typedef SkipList<BookEntry, buy_cmp> SingleBuyOrderBook;
+typedef SkipList<BookEntry, sell_cmp> SingleSellOrderBook;
+#else
+typedef SafeSet<BookEntry, buy_cmp> SingleBuyOrderBook;
+typedef SafeSet<BookEntry, sell_cmp> SingleSellOrderBook;
+#endif
+
+// All per-symbol state, created lazily on the first order for the symbol
+// or up front from the configured symbol universe.
+struct Instrument {
+    const SymbolKey symbol;
+    LightSwitches switches;
+    SingleBuyOrderBook buy_orders;
+    SingleSellOrderBook sell_orders;
+    std::unique_ptr<BookView> view; // for queries, kept by the sequencer
+    Sequencer sequencer;
+
+    // time priority within a price, counted per side
+    std::atomic<uint64_t> buy_sequence{0};
+    std::atomic<uint64_t> sell_sequence{0};
+
+    // open orders on both sides, and orders turned away by a limit
+    std::atomic<uint32_t> resting_orders{0};
+    std::atomic<uint64_t> rejected_orders{0};
+
+    // Auction symbols book new orders without matching them and cross the
+    // book periodically instead; only set at startup.
+    bool auction = false;
+    std::atomic<uint32_t> orders_since_auction{0};
+
+#ifdef LOCK_STATS
+    // contention on the symbol's order locks, its side lock and the
+    // counter locks of its two lightswitches, for report_metrics()
+    LockStats order_locks;
+    LockStats side_lock;
+    LockStats switch_locks;
+#endif
+
+    Instrument(SymbolKey symbol, bool sequenced, bool viewed, const Sequencer::ClosedHandler &on_closed,
+               size_t expected_depth = 0)
+            : symbol{symbol}, buy_orders{expected_depth}, sell_orders{expected_depth},
+              view{viewed ? std::make_unique<BookView>() : nullptr},
+              sequencer{symbol_name(symbol), sequenced, view.get(), on_closed} {
+#ifdef LOCK_STATS
+        switches.shared_m.count_into(side_lock);
+        switches.buy_lightswitch.count_into(switch_locks);
+        switches.sell_lightswitch.count_into(switch_locks);
+#endif
+    }
+};
+
+typedef SafeMap<SymbolKey, Instrument> InstrumentMap;
+
+// Estimated heap bytes an open order keeps alive: the Order and its
+// make_shared control block, its book node and its cancelable entry (hash
+// node plus bucket). The memory metrics and byte limits count in these.
+constexpr size_t resting_order_bytes = sizeof(Order) + 2 * sizeof(void *) +
+                                       SingleBuyOrderBook::node_size_estimate +
+                                       sizeof(std::pair<const uint32_t, std::shared_ptr<Order>>) +
+                                       2 * sizeof(void *);
+
+// What to do when an incoming order would execute against a resting order
+// placed by the same session.
+enum class SelfTradePrevention {
+    None,           // allow the self-trade
+    CancelResting,  // cancel the resting order and keep sweeping
+    CancelIncoming, // cancel the remainder of the incoming order, answered with 'R <id> <time>'
+    DecrementBoth   // reduce both by the overlapping quantity without executing, see prevent_self_trade()
+};
+
+// Parses the --stp= spelling shared by the engine and replay.
+inline bool parse_self_trade_prevention(const std::string &arg, SelfTradePrevention &stp) {
+    if (arg == "none") {
+        stp = SelfTradePrevention::None;
+    } else if (arg == "cancel-resting") {
+        stp = SelfTradePrevention::CancelResting;
+    } else if (arg == "cancel-incoming") {
+        stp = SelfTradePrevention::CancelIncoming;
+    } else if (arg == "decrement-both") {
+        stp = SelfTradePrevention::DecrementBoth;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+struct EngineConfig {
+    SelfTradePrevention stp = SelfTradePrevention::None;
+    bool cancel_on_disconnect = false;
+
+    // follow the executions of every sweep with one L record per price level
+    bool level_summary = false;
+
+    // prefix every output line with '<global seq> <symbol> <symbol seq>';
+    // rejects for unknown orders are numbered in the '-' stream
+    bool sequenced = false;
+
+    // connections run as coroutines on this many executor threads (0: one
+    // per CPU), unless each gets a blocking thread of its own
+    unsigned workers = 0;
+    bool thread_per_connection = false;
+
+    // symbols to create before the first connection, with the expected
+    // number of resting orders per side
+    std::vector<std::pair<std::string, uint32_t>> symbols;
+
+    // Hard limits on open orders per symbol and per session, 0 for none. A
+    // byte limit is converted to orders of resting_order_bytes each. A new
+    // order over a limit is answered with 'R <id> <time>' before it can
+    // match. Concurrent orders can overshoot a limit by one each.
+    uint32_t max_symbol_orders = 0;
+    uint64_t max_symbol_bytes = 0;
+    uint32_t max_session_orders = 0;
+    uint64_t max_session_bytes = 0;
+
+    // Symbols traded in periodic call auctions instead of continuously. New
+    // orders rest without matching; every auction_interval_ms if that is not
+    // 0, and after auction_orders new orders if that is not 0, the crossing
+    // part of the book executes at the one price that maximizes the executed
+    // volume. At least one of the two must be set.
+    // Self-trade prevention and level summaries do not apply to auctions.
+    std::vector<std::string> auction_symbols;
+    uint32_t auction_interval_ms = 10;
+    uint32_t auction_orders = 0;
+
+    // keep a BookView of every symbol, so that query() can answer
+    bool book_views = false;
+
+    // Ingress control per session. Executor workers take turns between
+    // sessions by deficit round robin: a turn reads and handles commands
+    // worth up to session_quantum, a command costing 1 and a mass cancel 1
+    // more per order it closes. session_rate limits each session to that
+    // many commands a second (0 for no limit), with bursts of session_burst
+    // (0 for a tenth of a second's worth). Input a session may not handle
+    // yet stays in its socket, so a flooding client fills its own buffers.
+    uint32_t session_quantum = 64;
+    uint32_t session_rate = 0;
+    uint32_t session_burst = 0;
+};
 
 struct Engine {
 public:
+    explicit Engine(EngineConfig config = {});
+
+    ~Engine();
+
     void accept(ClientConnection conn);
 
+    /*
+     * Transport independent entry points: a session per client, then its
+     * commands in order. Used by accept() and by the offline replay.
+     * Commands must have passed decode_commands().
+     */
+    std::shared_ptr<Session> open_session();
+
+    void handle(const std::shared_ptr<Session> &session, const ClientCommand &input);
+
+    void close_session(Session &session);
+
+    // Writes the memory accounting of every symbol and open session to
+    // stderr, one 'metrics ...' line each, and with LOCK_STATS the lock
+    // contention of every symbol.
+    void report_metrics();
+
+    /*
+     * Answers one line of the book query protocol from the symbol's latest
+     * BookView snapshot, without taking any book or order lock:
+     *   top <symbol> [<levels>]  'B|S <price> <count> <orders>' per level, best first (default 5 a side)
+     *   depth <symbol>           'B|S <price> <id> <count> <time>' per order, in priority order
+     *   order <symbol> <id>      'B|S <price> <id> <count> <time> <position>' while the order is open
+     * The answer ends with 'end <snapshot version>', or is a single
+     * 'error <reason>' line. Needs EngineConfig::book_views.
+     */
+    std::string query(const std::string &request);
+
 private:
-    // maps symbol <-> Orders
-    MultipleBuyOrderBooks buy_order_books;
-    MultipleSellOrderBooks sell_order_books;
+    const EngineConfig config;
+
+    // open order limits from the config, UINT32_MAX for none
+    const uint32_t symbol_order_limit;
+    const uint32_t session_order_limit;
+
+    // session ids are handed out per accepted connection, 0 is never used
+    std::atomic<uint32_t> next_session_id{1};
+
+    // maps symbol <-> {mutexes, buy orders, sell orders}
+    InstrumentMap instruments;
 
-    // maps order_id <-> {symbol, (buy/sell)}
+    // open orders by order_id, for cancels; closed ones are dropped once
+    // their last output is written
     CancelMap cancelable;
 
-    // map symbol <-> set of mutexes
-    MutexMap mutexes;
+    // every instrument's Sequencer::ClosedHandler
+    const Sequencer::ClosedHandler forget_closed{[this](const std::shared_ptr<Order> &order) { forget(order); }};
 
-    void buy(uint32_t id, const char *symbol, uint32_t price, uint32_t count);
+    // open sessions, for the metrics
+    SafeMap<uint32_t, std::weak_ptr<Session>> sessions;
 
-    void sell(uint32_t id, const char *symbol, uint32_t price, uint32_t count);
+    // Session::throttled and Session::deferred of all sessions ever opened
+    std::atomic<uint64_t> throttled_turns{0};
+    std::atomic<uint64_t> deferred_turns{0};
+
+    // output that belongs to no instrument: cancels of unknown orders
+    Sequencer unknown_orders;
+
+    void buy(const std::shared_ptr<Session> &session, uint32_t id, SymbolKey symbol, uint32_t price,
+             uint32_t count);
+
+    void sell(const std::shared_ptr<Session> &session, uint32_t id, SymbolKey symbol, uint32_t price,
+              uint32_t count);
 
     void cancel(uint32_t id);
 
-    void connection_thread(ClientConnection conn);
+    void cancel_session_orders(Session &session);
+
+    // runs the connections, created by the first accept()
+    std::unique_ptr<Executor> executor;
+
+    // Good-till-time orders, in millisecond ticks since expiry_epoch. The
+    // expiry thread is started by the first order with a time to live.
+    // Lock order: Order::order_mutex, then expiry_mutex.
+    std::mutex expiry_mutex;
+    std::condition_variable expiry_wakeup;
+    ExpiryWheel expiries;
+    bool expiry_stopping = false;
+    std::once_flag expiry_started;
+    std::thread expiry_thread;
+    const std::chrono::steady_clock::time_point expiry_epoch = std::chrono::steady_clock::now();
+
+    void schedule_expiry(const std::shared_ptr<Order> &order, uint32_t ttl_ms);
+
+    void cancel_expiry(Order &order);
+
+    void run_expiry();
+
+    void cancel_orders(std::vector<std::shared_ptr<Order>> &orders);
+
+    // call auctions, run by auction_thread on the configured interval
+    std::vector<Instrument *> auction_instruments;
+    std::mutex auction_mutex;
+    std::condition_variable auction_wakeup;
+    bool auction_stopping = false;
+    std::thread auction_thread;
+
+    void run_auctions();
+
+    void cross(Instrument &instrument);
+
+    void connection_thread(ClientConnection conn, std::shared_ptr<Session> session);
+
+    Task connection_task(ClientConnection conn, std::shared_ptr<Session> session);
+
+    // Handles the batch and returns what it cost the session's turn.
+    uint64_t handle_batch(const std::shared_ptr<Session> &session, CommandBatch &batch);
+
+    // The session's rate limit, empty without EngineConfig::session_rate.
+    std::optional<TokenBucket> session_bucket() const;
+
+    // How many commands the session's next read may take: at most wanted,
+    // and only as many as its bucket has tokens. Counts a throttled turn
+    // when that is none.
+    uint32_t admit(Session &session, std::optional<TokenBucket> &bucket, uint32_t wanted);
 
     /*
      * Helper functions
      */
-    void insert_buy_order(const char *symbol, std::shared_ptr<Order> new_order);
+    void preregister_symbols();
+
+    Instrument &instrument(SymbolKey symbol);
+
+    void insert_buy_order(Instrument &instrument, std::shared_ptr<Order> new_order);
+
+    static uint32_t order_limit(uint32_t orders, uint64_t bytes);
+
+    bool over_limit(Instrument &instrument, const Session &session) const;
+
+    void reject(Instrument &instrument, uint32_t id);
 
     static bool is_matching(const uint32_t &active_buy_price, const uint32_t &resting_sell_price);
 
 #ifdef DEBUG
-    void order_book_stat(const char* symbol);
+    void order_book_stat(SymbolKey symbol);
 #endif
 
-    void insert_sell_order(const char *symbol, std::shared_ptr<Order> new_order);
+    void insert_sell_order(Instrument &instrument, std::shared_ptr<Order> new_order);
+
+    void release_order(Order &order, std::vector<std::shared_ptr<Order>> &closed);
+
+    void forget(const std::shared_ptr<Order> &order);
+
+    static bool is_released(const BookEntry &entry);
+
+    bool process_matching_order(uint32_t session, uint32_t id, const BookEntry &resting, bool resting_is_sell,
+                                uint32_t &count, EventBatch &batch);
+
+    bool replenish(const std::shared_ptr<Order> &order, bool is_sell, EventBatch &batch);
+
+    bool prevent_self_trade(uint32_t id, Order &resting_order, uint32_t &count, EventBatch &batch);
+
+    static OutputEvent added_event(uint32_t id, SymbolKey symbol, uint32_t price, uint32_t count, bool is_sell_side,
+                                   intmax_t timestamp);
 
-    bool process_matching_order(uint32_t id, OrderBook_iterator current_order, uint32_t &count);
+    static OutputEvent deleted_event(uint32_t id, bool accepted);
 };
 
 inline std::chrono::microseconds::rep getCurrentTimestamp() noexcept {
@@ -0,0 +1,547 @@
+// Multi-threaded stress test of the whole Engine: every thread is a session
+// trading a few hot symbols with random buys, sells, cancels, short times to
+// live, icebergs and the odd mass cancel. The engine output is captured and replayed
+// against a model of every order afterwards, and the run time doubles as a
+// throughput figure for the thread count. Build it plain for the benchmark, or with
+// -fsanitize=thread / -fsanitize=address, see scripts/engine_stress_test.sh.
+//
+// Checked invariants:
+//  - quantity is conserved: an order's executions as the incoming side plus
+//    what it rested with add up to what was submitted; an iceberg rests
+//    with slices of at most its display quantity, the next one only after
+//    the last one filled, and a filled iceberg has traded all of it
+//  - no over-fill: a resting order never executes more than it rested with,
+//    execution counts are positive and execution ids count up
+//  - executions cross: never above a buy's or below a sell's limit
+//  - every cancel is answered exactly once, a mass cancel or expiry at most
+//    once more per order, and an order is accepted as cancelled at most once
+//  - the engine's open order accounting matches the orders left open, and
+//    so do the orders it keeps for cancels
+//  - the book query answers list exactly the orders left open, with their
+//    prices and remaining counts; a query thread runs during the trading
+//  - a mass cancel writes the deletes of each symbol as one block
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine.hpp"
+
+struct StressConfig {
+    unsigned threads = 4;
+    unsigned long ops = 50000;
+    unsigned symbols = 2;
+    uint64_t seed = 1;
+};
+
+struct Submitted {
+    uint32_t price = 0;
+    uint32_t count = 0; // 0: the id was never used
+    bool is_sell = false;
+    uint32_t cancels = 0;  // cancel commands sent for the id
+    bool mass_cancelled = false; // its session sent a mass cancel after it
+    bool expires = false;
+    uint32_t display = 0; // the session's display quantity when it was sent
+};
+
+struct Observed {
+    uint64_t filled_incoming = 0;
+    uint64_t rested = 0; // all slices it was added with
+    uint32_t remaining = 0;
+    uint32_t next_execution = 1;
+    uint32_t cancel_lines = 0;
+    bool added = false;
+    bool open = false;
+    bool cancel_accepted = false;
+};
+
+class Checker {
+private:
+    const std::vector<Submitted> &submitted;
+    std::vector<Observed> observed;
+    uint64_t line_no = 0;
+    uint64_t violations = 0;
+
+    void violation(const char *what, uint32_t id) {
+        if (++violations <= 20) {
+            fprintf(stderr, "line %llu: %s (order %u)\n", static_cast<unsigned long long>(line_no), what, id);
+        }
+    }
+
+    bool known(uint32_t id) {
+        if (id < submitted.size() && submitted[id].count > 0) {
+            return true;
+        }
+        violation("unknown order id", id);
+        return false;
+    }
+
+    void added(uint32_t id, uint32_t count) {
+        if (!known(id)) {
+            return;
+        }
+        Observed &o = observed[id];
+        const Submitted &s = submitted[id];
+        const uint64_t left = s.count - std::min<uint64_t>(o.filled_incoming + o.rested, s.count);
+        if (o.added) {
+            // an iceberg's next slice, once the last one filled
+            if (s.display == 0 || o.open || o.cancel_accepted) {
+                violation("order added twice", id);
+            }
+            if (count > std::min<uint64_t>(s.display, left)) {
+                violation("iceberg slice larger than its display quantity or reserve", id);
+            }
+            ++o.next_execution;
+        } else if (count != std::min<uint64_t>(s.display > 0 ? s.display : UINT32_MAX, left)) {
+            violation("executed and rested quantity differ from the submitted quantity", id);
+        }
+        o.rested += count;
+        o.added = true;
+        o.open = true;
+        o.remaining = count;
+    }
+
+    void executed(uint32_t resting, uint32_t incoming, uint32_t execution, uint32_t price, uint32_t count) {
+        if (!known(resting) || !known(incoming)) {
+            return;
+        }
+        Observed &r = observed[resting];
+        Observed &in = observed[incoming];
+        if (!r.open) {
+            violation(r.added ? "execution against a closed order" : "execution before the order rested", resting);
+            return;
+        }
+        if (in.added) {
+            violation("execution after the incoming order rested", incoming);
+        }
+        if (execution != r.next_execution) {
+            violation("execution id out of order", resting);
+        }
+        if (price != submitted[resting].price) {
+            violation("execution away from the resting price", resting);
+        }
+        const Submitted &s = submitted[incoming];
+        if (s.is_sell == submitted[resting].is_sell || (s.is_sell ? price < s.price : price > s.price)) {
+            violation("execution does not cross", incoming);
+        }
+        if (count == 0 || count > r.remaining) {
+            violation("over-fill", resting);
+            count = r.remaining;
+        }
+        r.remaining -= count;
+        r.open = r.remaining > 0;
+        r.next_execution += r.open;
+        in.filled_incoming += count;
+    }
+
+    void deleted(uint32_t id, bool accepted) {
+        if (!known(id)) {
+            return;
+        }
+        Observed &o = observed[id];
+        ++o.cancel_lines;
+        if (accepted) {
+            if (!o.open || o.cancel_accepted) {
+                violation("cancel accepted for an order that is not open", id);
+            }
+            o.cancel_accepted = true;
+            o.open = false;
+        } else if (o.open) {
+            violation("cancel rejected for an open order", id);
+        }
+    }
+
+public:
+    explicit Checker(const std::vector<Submitted> &submitted)
+            : submitted{submitted}, observed(submitted.size()) {}
+
+    void line(const std::string &text) {
+        ++line_no;
+        std::istringstream in(text);
+        char kind;
+        in >> kind;
+        uint32_t a = 0, b = 0, c = 0, d = 0, e = 0;
+        std::string symbol, word;
+        switch (kind) {
+            case 'B':
+            case 'S':
+                in >> a >> symbol >> b >> c;
+                added(a, c);
+                break;
+            case 'E':
+                in >> a >> b >> c >> d >> e;
+                executed(a, b, c, d, e);
+                break;
+            case 'X':
+                in >> a >> word;
+                deleted(a, word == "A");
+                break;
+            default:
+                violation("unexpected line", 0);
+                break;
+        }
+    }
+
+    // After the last line: the never rested orders must have filled
+    // completely, and the cancels add up. Returns the orders left open.
+    uint64_t finish() {
+        uint64_t open = 0;
+        for (uint32_t id = 0; id < submitted.size(); ++id) {
+            const Submitted &s = submitted[id];
+            const Observed &o = observed[id];
+            if (s.count == 0) {
+                continue;
+            }
+            if (!o.added && o.filled_incoming != s.count) {
+                violation("order neither rested nor filled", id);
+            }
+            if (o.cancel_lines < s.cancels || o.cancel_lines > s.cancels + (s.mass_cancelled || s.expires)) {
+                violation("cancels not answered exactly once", id);
+            }
+            if (o.added && !o.open && !o.cancel_accepted && o.filled_incoming + o.rested != s.count) {
+                violation("filled order did not trade all of its quantity", id);
+            }
+            open += o.open;
+        }
+        return open;
+    }
+
+    // Every open order must be in the depth answers of all the symbols,
+    // with what it has left.
+    void check_view(const std::string &depth) {
+        std::map<uint32_t, uint32_t> listed;
+        std::istringstream in(depth);
+        std::string line;
+        while (std::getline(in, line)) {
+            char side;
+            uint32_t price = 0, id = 0, count = 0;
+            if (sscanf(line.c_str(), "%c %u %u %u", &side, &price, &id, &count) != 4 || side == 'e') {
+                continue;
+            }
+            if (!known(id) || !observed[id].open || observed[id].remaining != count ||
+                submitted[id].price != price || submitted[id].is_sell != (side == 'S')) {
+                violation("query lists an order differently from the output", id);
+            }
+            listed[id] = count;
+        }
+        for (uint32_t id = 0; id < submitted.size(); ++id) {
+            if (observed[id].open && listed.count(id) == 0) {
+                violation("open order missing from the query answers", id);
+            }
+        }
+    }
+
+    uint64_t lines() const { return line_no; }
+
+    uint64_t errors() const { return violations; }
+};
+
+// Engine::report_metrics() writes to stderr; pick one of the engine totals out of it.
+static uint64_t engine_metric(Engine &engine, const std::string &name) {
+    std::ostringstream metrics;
+    std::streambuf *original = std::cerr.rdbuf(metrics.rdbuf());
+    engine.report_metrics();
+    std::cerr.rdbuf(original);
+
+    std::istringstream in(metrics.str());
+    std::string line;
+    const std::string prefix = "metrics engine ";
+    while (std::getline(in, line)) {
+        if (line.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        std::istringstream fields(line.substr(prefix.size()));
+        std::string key;
+        uint64_t value;
+        while (fields >> key >> value) {
+            if (key == name) {
+                return value;
+            }
+        }
+    }
+    return UINT64_MAX;
+}
+
+static std::string symbol_name(unsigned symbol) {
+    return "HOT" + std::to_string(symbol % 100000);
+}
+
+// Counts the blocks written to std::cout, Output::Publish flushes once per block.
+class FlushCounter : public std::stringbuf {
+public:
+    unsigned flushes = 0;
+
+protected:
+    int sync() override {
+        ++flushes;
+        return std::stringbuf::sync();
+    }
+};
+
+// One session books several batches' worth of orders on two symbols, then
+// cancels them all at once.
+static bool mass_cancel_check() {
+    Engine engine;
+    auto session = engine.open_session();
+    const unsigned orders = 3 * EventBatch::capacity;
+
+    FlushCounter output;
+    std::streambuf *original = std::cout.rdbuf(&output);
+    for (unsigned i = 1; i <= orders; ++i) {
+        ClientCommand cmd{};
+        cmd.type = input_buy;
+        cmd.order_id = i;
+        cmd.price = 100 + i % 5;
+        cmd.count = 1;
+        snprintf(cmd.instrument, sizeof(cmd.instrument), "%s", symbol_name(i % 2).c_str());
+        engine.handle(session, cmd);
+    }
+    const unsigned before = output.flushes;
+    ClientCommand mass_cancel{};
+    mass_cancel.type = input_mass_cancel;
+    engine.handle(session, mass_cancel);
+    const unsigned blocks = output.flushes - before;
+    std::cout.rdbuf(original);
+
+    std::istringstream lines(output.str());
+    std::string line;
+    unsigned deletes = 0;
+    while (std::getline(lines, line)) {
+        deletes += line.compare(0, 2, "X ") == 0;
+    }
+    if (blocks != 2 || deletes != orders) {
+        fprintf(stderr, "mass cancel of %u orders on 2 symbols wrote %u deletes in %u blocks\n", orders, deletes,
+                blocks);
+        return false;
+    }
+    return true;
+}
+
+// One buy sweeps three price levels, 103 executions and an iceberg that is
+// refilled twice on the way, so its events span several batches. Each level
+// must still be summarized once, after the last execution.
+static bool level_summary_check() {
+    EngineConfig config;
+    config.level_summary = true;
+    Engine engine{config};
+    auto seller = engine.open_session();
+    auto buyer = engine.open_session();
+
+    std::ostringstream output;
+    std::streambuf *original = std::cout.rdbuf(output.rdbuf());
+    auto send = [&](const std::shared_ptr<Session> &session, CommandType type, uint32_t id, uint32_t price,
+                    uint32_t count) {
+        ClientCommand cmd{};
+        cmd.type = type;
+        cmd.order_id = id;
+        cmd.price = price;
+        cmd.count = count;
+        snprintf(cmd.instrument, sizeof(cmd.instrument), "%s", symbol_name(0u).c_str());
+        engine.handle(session, cmd);
+    };
+    for (uint32_t id = 1; id <= 100; ++id) {
+        send(seller, input_sell, id, id <= 40 ? 100 : id <= 80 ? 101 : 102, 1);
+    }
+    send(seller, input_iceberg, 0, 0, 2);
+    send(seller, input_sell, 101, 101, 6);
+    send(buyer, input_buy, 1000, 102, 106);
+    std::cout.rdbuf(original);
+
+    const std::map<uint32_t, std::pair<uint32_t, uint32_t>> expected{{100, {40, 40}}, {101, {46, 43}},
+                                                                     {102, {20, 20}}};
+    std::map<uint32_t, std::pair<uint32_t, uint32_t>> summarized;
+    std::istringstream lines(output.str());
+    std::string line;
+    bool executed_after_summary = false;
+    while (std::getline(lines, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        uint32_t id = 0, price = 0, count = 0, executions = 0;
+        fields >> kind;
+        if (kind == "E") {
+            executed_after_summary |= !summarized.empty();
+        } else if (kind == "L" && fields >> id >> price >> count >> executions) {
+            if (id != 1000 || summarized.count(price) > 0) {
+                summarized.clear();
+                break;
+            }
+            summarized[price] = {count, executions};
+        }
+    }
+    if (executed_after_summary || summarized != expected) {
+        fprintf(stderr, "a sweep of three levels was not summarized once per level:\n%s", output.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool run(const StressConfig &cfg) {
+    EngineConfig config;
+    config.book_views = true;
+    Engine engine{config};
+    std::vector<Submitted> submitted(cfg.threads * cfg.ops + 1);
+
+    std::ostringstream output;
+    std::streambuf *original = std::cout.rdbuf(output.rdbuf());
+
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < cfg.threads; ++t) {
+        workers.emplace_back([&, t] {
+            auto session = engine.open_session();
+            std::mt19937_64 rng(cfg.seed * 1000003 + t);
+            std::vector<uint32_t> mine;
+            uint32_t ttl_ms = 0;
+            uint32_t display = 0;
+            for (unsigned long i = 0; i < cfg.ops; ++i) {
+                ClientCommand cmd{};
+                unsigned roll = rng() % 1000;
+                if (roll < 5) {
+                    // mostly gone within a few ticks, so the wheel keeps expiring
+                    cmd.type = input_time_to_live;
+                    cmd.count = ttl_ms = static_cast<uint32_t>(rng() % 4);
+                } else if (roll < 10) {
+                    // small slices of orders of up to 20, so they replenish a lot
+                    cmd.type = input_iceberg;
+                    cmd.count = display = static_cast<uint32_t>(rng() % 6);
+                } else if (roll == 10) {
+                    // ids are only written by this thread until the join
+                    for (uint32_t id: mine) {
+                        submitted[id].mass_cancelled = true;
+                    }
+                    cmd.type = input_mass_cancel;
+                } else if (!mine.empty() && roll < 300) {
+                    cmd.type = input_cancel;
+                    cmd.order_id = mine[rng() % mine.size()];
+                    ++submitted[cmd.order_id].cancels;
+                } else {
+                    cmd.type = rng() % 2 ? input_buy : input_sell;
+                    cmd.order_id = static_cast<uint32_t>(i * cfg.threads + t + 1);
+                    cmd.price = 100 + rng() % 7;
+                    cmd.count = 1 + rng() % 20;
+                    snprintf(cmd.instrument, sizeof(cmd.instrument), "%s",
+                             symbol_name(static_cast<unsigned>(rng() % cfg.symbols)).c_str());
+                    submitted[cmd.order_id] = {cmd.price, cmd.count, cmd.type == input_sell, 0, false, ttl_ms > 0,
+                                               display};
+                    mine.push_back(cmd.order_id);
+                }
+                engine.handle(session, cmd);
+            }
+        });
+    }
+    // queries only read snapshots, so this must not disturb the trading
+    std::atomic<bool> trading{true};
+    std::thread querier([&] {
+        for (unsigned i = 0; trading.load(std::memory_order_relaxed); ++i) {
+            engine.query((i % 2 ? "depth " : "top ") + symbol_name(i % cfg.symbols));
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    });
+    for (auto &w: workers) {
+        w.join();
+    }
+    trading.store(false);
+    querier.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    // let the last expiries land, times to live are at most 3 ms
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::string text;
+    {
+        std::lock_guard<std::mutex> guard(SyncCout::mut); // the expiry thread may still write
+        std::cout.rdbuf(original);
+        text = output.str();
+    }
+
+    Checker checker(submitted);
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        checker.line(line);
+    }
+    std::string depth;
+    for (unsigned symbol = 0; symbol < cfg.symbols; ++symbol) {
+        depth += engine.query("depth " + symbol_name(symbol));
+    }
+    checker.check_view(depth);
+    uint64_t open = checker.finish();
+    uint64_t accounted = engine_metric(engine, "resting_orders");
+    uint64_t tracked = engine_metric(engine, "tracked_orders");
+    bool ok = checker.errors() == 0 && accounted == open && tracked == open;
+    if (accounted != open || tracked != open) {
+        fprintf(stderr, "engine accounts %llu open orders and tracks %llu for cancels, the output leaves %llu\n",
+                static_cast<unsigned long long>(accounted), static_cast<unsigned long long>(tracked),
+                static_cast<unsigned long long>(open));
+    }
+
+    unsigned long total = cfg.ops * cfg.threads;
+    printf("%3u threads %8.1f ns/cmd %10.0f commands/s  %llu lines, %llu open, %llu violations\n", cfg.threads,
+           elapsed * 1e9 / total, total / elapsed, static_cast<unsigned long long>(checker.lines()),
+           static_cast<unsigned long long>(open), static_cast<unsigned long long>(checker.errors()));
+    return ok;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [--threads=<n>] [--ops=<n>] [--symbols=<n>] [--seed=<n>]\n"
+            "  --threads=<n>  sessions trading at the same time (default 4)\n"
+            "  --ops=<n>      commands per session (default 50000)\n"
+            "  --symbols=<n>  hot symbols they share (default 2)\n"
+            "  --seed=<n>     random seed (default 1)\n",
+            argv0);
+}
+
+int main(int argc, char *argv[]) {
+    StressConfig cfg;
+
+    static const struct option long_options[] = {
+            {"threads", required_argument, nullptr, 't'},
+            {"ops",     required_argument, nullptr, 'o'},
+            {"symbols", required_argument, nullptr, 's'},
+            {"seed",    required_argument, nullptr, 'r'},
+            {nullptr, 0,                   nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 't':
+                cfg.threads = static_cast<unsigned>(strtoul(optarg, nullptr, 10));
+                break;
+            case 'o':
+                cfg.ops = strtoul(optarg, nullptr, 10);
+                break;
+            case 's':
+                cfg.symbols = static_cast<unsigned>(strtoul(optarg, nullptr, 10));
+                break;
+            case 'r':
+                cfg.seed = strtoull(optarg, nullptr, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (cfg.threads == 0 || cfg.symbols == 0 || cfg.ops == 0 ||
+        static_cast<uint64_t>(cfg.threads) * cfg.ops >= UINT32_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!mass_cancel_check() || !level_summary_check() || !run(cfg)) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
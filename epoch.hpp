@@ -0,0 +1,131 @@
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * Epoch-based reclamation for the lock-free containers.
+ *
+ * A thread pins itself before it follows links that another thread may
+ * unlink, and the pin records the global epoch it started in. Unlinking a
+ * node advances the epoch and tags the node with the epoch before the
+ * advance; the node may be freed once every pinned thread started after
+ * that, because no such thread can have found it. Pins nest, only the
+ * outermost one is published, so a thread that keeps an iterator stays
+ * pinned for as long as it holds it.
+ *
+ * Every thread gets one record for the life of the process; a record is
+ * taken over by the next new thread after its owner exits.
+ */
+class EpochDomain {
+private:
+    struct alignas(64) Record {
+        std::atomic<uint64_t> local{0}; // epoch the outermost pin started in, 0 when not pinned
+        std::atomic<bool> in_use{true};
+        Record *next = nullptr;
+    };
+
+    // the thread's record and its pin depth, handed back at thread exit
+    struct Owner {
+        Record *record = nullptr;
+        unsigned depth = 0;
+
+        ~Owner() {
+            if (record != nullptr) {
+                record->local.store(0, std::memory_order_release);
+                record->in_use.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    std::atomic<uint64_t> global{1};
+    std::atomic<Record *> records{nullptr};
+
+    Record *acquire_record() {
+        for (Record *r = records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+            bool free = false;
+            if (!r->in_use.load(std::memory_order_relaxed) &&
+                r->in_use.compare_exchange_strong(free, true, std::memory_order_acquire)) {
+                return r;
+            }
+        }
+        Record *r = new Record;
+        Record *head = records.load(std::memory_order_relaxed);
+        do {
+            r->next = head;
+        } while (!records.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+        return r;
+    }
+
+    Owner &owner() {
+        thread_local Owner o;
+        if (o.record == nullptr) {
+            o.record = acquire_record();
+        }
+        return o;
+    }
+
+public:
+    static EpochDomain &instance() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    void pin() {
+        Owner &o = owner();
+        if (o.depth++ > 0) {
+            return;
+        }
+        // publish the epoch, then make sure it was still current once
+        // visible, or an unlink in between could be missed by the reclaimer
+        uint64_t e = global.load(std::memory_order_seq_cst);
+        while (true) {
+            o.record->local.store(e, std::memory_order_seq_cst);
+            uint64_t now = global.load(std::memory_order_seq_cst);
+            if (now == e) {
+                break;
+            }
+            e = now;
+        }
+    }
+
+    void unpin() {
+        Owner &o = owner();
+        if (--o.depth == 0) {
+            o.record->local.store(0, std::memory_order_release);
+        }
+    }
+
+    // Called after a node is unlinked; returns the epoch to tag it with.
+    uint64_t retire_epoch() {
+        return global.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // Nodes retired before the call and tagged with an epoch below this may
+    // be freed.
+    uint64_t safe_epoch() {
+        uint64_t oldest = global.load(std::memory_order_seq_cst);
+        for (Record *r = records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+            uint64_t e = r->local.load(std::memory_order_seq_cst);
+            if (e != 0 && e < oldest) {
+                oldest = e;
+            }
+        }
+        return oldest;
+    }
+};
+
+// Keeps the calling thread pinned while it lives; copies pin again.
+class EpochPin {
+public:
+    EpochPin() { EpochDomain::instance().pin(); }
+
+    EpochPin(const EpochPin &) { EpochDomain::instance().pin(); }
+
+    EpochPin &operator=(const EpochPin &) { return *this; }
+
+    ~EpochPin() { EpochDomain::instance().unpin(); }
+};
+
+#endif // EPOCH_HPP
@@ -0,0 +1,156 @@
+#ifndef EVENTBATCH_HPP
+#define EVENTBATCH_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "io.hpp"
+#include "order.hpp"
+#include "sequencer.hpp"
+
+/*
+ * Output of one matching pass, collected on the stack instead of being
+ * written event by event.
+ *
+ * Every order an event refers to stays locked until the batch takes its
+ * number from the instrument's Sequencer, so no other thread can sequence
+ * a later change to it first. The locks are released right after that and
+ * the events are staged with the sequencer, which is all publish() does,
+ * so a sweep may publish while it holds its side of the book. The output
+ * itself is written by flush(), or the destructor, once the caller holds
+ * no lock any more. Orders the events close are staged with them.
+ *
+ * With level summaries the batch lives for the whole sweep and keeps the
+ * totals per price across its publishes; the last one, from flush(),
+ * stages them.
+ */
+class EventBatch {
+public:
+    static constexpr size_t capacity = 64;
+
+    EventBatch(Sequencer &sequencer, bool level_summary) : sequencer{sequencer}, level_summary{level_summary} {}
+
+    EventBatch(const EventBatch &) = delete;
+
+    EventBatch &operator=(const EventBatch &) = delete;
+
+    ~EventBatch() {
+        flush();
+    }
+
+    // Keeps the order locked until the batch is sequenced.
+    void hold(std::unique_lock<OrderMutex> &&lock) {
+        held[n_held++] = lock.release();
+    }
+
+    void add(const OutputEvent &event) {
+        events[n_events++] = event;
+    }
+
+    // Orders closed by the events added so far, handed on at publish().
+    std::vector<std::shared_ptr<Order>> &closed_orders() {
+        return closed;
+    }
+
+    // Room for at least one more held order and that many events.
+    bool full(size_t events = 1) const {
+        return n_events + events > capacity || n_held == capacity;
+    }
+
+    void publish() {
+        publish_batch(false);
+    }
+
+    // Publishes what is left and writes out the output; no lock may be held.
+    void flush() {
+        publish_batch(true);
+        if (staged) {
+            sequencer.drain(last_seq);
+            staged = false;
+        }
+    }
+
+private:
+    Sequencer &sequencer;
+    const bool level_summary;
+    size_t n_events = 0;
+    size_t n_held = 0;
+    bool staged = false;
+    uint64_t last_seq = 0;
+    OutputEvent events[capacity];
+    OrderMutex *held[capacity];
+    std::vector<std::shared_ptr<Order>> closed;
+    std::vector<OutputEvent> summaries; // of the whole sweep, with level_summary
+
+    void release_held() {
+        for (size_t i = 0; i < n_held; ++i) {
+            held[i]->unlock();
+        }
+        n_held = 0;
+    }
+
+    void publish_batch(bool last) {
+        if (level_summary) {
+            summarize();
+        }
+        const bool with_summaries = last && !summaries.empty();
+        if (n_events == 0 && closed.empty() && !with_summaries) {
+            release_held();
+            return;
+        }
+
+        const uint64_t seq = sequencer.next();
+        release_held();
+        if (with_summaries) {
+            stage_with_level_summaries(seq);
+        } else {
+            sequencer.stage(seq, events, n_events, &closed);
+        }
+        n_events = 0;
+        staged = true;
+        last_seq = seq;
+    }
+
+    // Adds the executions of the batch to the sweep's summaries, one per run
+    // of executions at the same price. A sweep publishes every 64 events and
+    // on each iceberg refill, so the totals have to outlive the batch.
+    void summarize() {
+        for (size_t i = 0; i < n_events; ++i) {
+            const OutputEvent &e = events[i];
+            if (e.kind != OutputEvent::Executed) {
+                continue;
+            }
+            OutputEvent *last = summaries.empty() ? nullptr : &summaries.back();
+            if (last != nullptr && last->price == e.price && last->id == e.other_id) {
+                last->count += e.count;
+                last->execution_id += 1;
+                last->timestamp = e.timestamp;
+            } else {
+                summaries.push_back({OutputEvent::LevelSummary, false, e.other_id, 0, 1, e.price, e.count,
+                                     {}, e.timestamp});
+            }
+        }
+    }
+
+    // The summaries go right after the last execution of the sweep: after
+    // the last one in this batch, or first if earlier batches had them all.
+    void stage_with_level_summaries(uint64_t seq) {
+        size_t split = 0;
+        for (size_t i = 0; i < n_events; ++i) {
+            if (events[i].kind == OutputEvent::Executed) {
+                split = i + 1;
+            }
+        }
+
+        std::vector<OutputEvent> out;
+        out.reserve(n_events + summaries.size());
+        out.insert(out.end(), events, events + split);
+        out.insert(out.end(), summaries.begin(), summaries.end());
+        out.insert(out.end(), events + split, events + n_events);
+        summaries.clear();
+        sequencer.stage(seq, out.data(), out.size(), &closed);
+    }
+};
+
+#endif // EVENTBATCH_HPP
@@ -0,0 +1,183 @@
+// This file contains the coroutine executor and its epoll reactor.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "executor.hpp"
+
+// index of the worker the calling thread runs, or none
+static constexpr size_t not_a_worker = SIZE_MAX;
+static thread_local size_t current_worker = not_a_worker;
+
+Executor::Executor(unsigned n) {
+    if (n == 0) {
+        n = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epoll_fd == -1 || stop_fd == -1) {
+        perror("executor");
+        abort();
+    }
+    struct epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr; // the only event without a coroutine
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+
+    for (unsigned i = 0; i < n; ++i) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->thread = std::thread(&Executor::run_worker, this, i);
+    }
+    reactor = std::thread(&Executor::run_reactor, this);
+}
+
+// Coroutines still suspended at this point are abandoned, not destroyed.
+Executor::~Executor() {
+    stopping.store(true);
+    {
+        std::lock_guard<std::mutex> guard(sleep_mutex);
+        work_available.notify_all();
+    }
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("executor stop");
+    }
+
+    for (auto &w: workers) {
+        w->thread.join();
+    }
+    reactor.join();
+    close(stop_fd);
+    close(epoll_fd);
+}
+
+void Executor::spawn(Task task) {
+    schedule(task.handle);
+}
+
+// A worker keeps what it schedules itself; everything else is spread round robin.
+void Executor::schedule(std::coroutine_handle<> h) {
+    size_t target = current_worker != not_a_worker
+                    ? current_worker
+                    : next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+        std::lock_guard<std::mutex> guard(workers[target]->mtx);
+        workers[target]->queue.push_back(h);
+    }
+    queued.fetch_add(1);
+    if (sleepers.load() > 0) {
+        std::lock_guard<std::mutex> guard(sleep_mutex);
+        work_available.notify_one();
+    }
+}
+
+// One shot: the descriptor has to be watched again after every resume, so
+// a coroutine is never resumed twice for the same wait.
+void Executor::watch(int fd, uint32_t events, std::coroutine_handle<> h) {
+    struct epoll_event ev {};
+    ev.events = events | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = h.address();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+        return;
+    }
+    if (errno == ENOENT && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        return;
+    }
+    // not pollable: let the coroutine find out from its next read
+    perror("epoll_ctl");
+    schedule(h);
+}
+
+// A one shot timerfd, watched like any descriptor; the coroutine closes it
+// when it resumes. Without one it only yields. timer_fd is set before the
+// watch, as the coroutine can resume on another worker right after it.
+void Executor::watch_timer(std::chrono::nanoseconds delay, int &timer_fd, std::coroutine_handle<> h) {
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd == -1) {
+        perror("timerfd_create");
+        schedule(h);
+        return;
+    }
+    struct itimerspec spec {};
+    spec.it_value.tv_sec = delay.count() / 1'000'000'000;
+    spec.it_value.tv_nsec = delay.count() % 1'000'000'000;
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+    watch(timer_fd, EPOLLIN, h);
+}
+
+void Executor::close_timer(int timer_fd) {
+    if (timer_fd != -1) {
+        close(timer_fd); // also takes it out of the epoll set
+    }
+}
+
+// Own queue from the front, otherwise steal from the back of the others.
+std::coroutine_handle<> Executor::take(size_t self) {
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker &w = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(w.mtx);
+        if (w.queue.empty()) {
+            continue;
+        }
+        std::coroutine_handle<> h;
+        if (i == 0) {
+            h = w.queue.front();
+            w.queue.pop_front();
+        } else {
+            h = w.queue.back();
+            w.queue.pop_back();
+        }
+        queued.fetch_sub(1);
+        return h;
+    }
+    return nullptr;
+}
+
+void Executor::run_worker(size_t self) {
+    current_worker = self;
+    while (true) {
+        if (std::coroutine_handle<> h = take(self)) {
+            h.resume();
+            continue;
+        }
+
+        // seq_cst on sleepers and queued pairs with schedule(): either it
+        // sees this sleeper and notifies, or we see its work and do not wait
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleepers.fetch_add(1);
+        work_available.wait(lock, [&] { return queued.load() > 0 || stopping.load(); });
+        sleepers.fetch_sub(1);
+        if (stopping.load()) {
+            return;
+        }
+    }
+}
+
+void Executor::run_reactor() {
+    struct epoll_event events[64];
+    while (!stopping.load()) {
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr != nullptr) {
+                schedule(std::coroutine_handle<>::from_address(events[i].data.ptr));
+            }
+        }
+    }
+}
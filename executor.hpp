@@ -0,0 +1,148 @@
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/epoll.h>
+
+/*
+ * Fire-and-forget coroutine: it starts once handed to Executor::spawn()
+ * and its frame is freed when it returns.
+ */
+struct Task {
+    struct promise_type {
+        Task get_return_object() {
+            return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/*
+ * Runs coroutines on a few worker threads.
+ *
+ * Every worker has its own FIFO run queue and takes from the back of
+ * another worker's queue when its own is empty, so a worker that is stuck
+ * in a long matching pass does not hold up the sessions queued behind it.
+ * Idle workers sleep on a condition variable. One reactor thread waits in
+ * epoll for the file descriptors coroutines are suspended on, and queues a
+ * coroutine again once its descriptor is ready.
+ *
+ * Coroutines must not hold a lock across a co_await: they can resume on a
+ * different worker.
+ */
+class Executor {
+public:
+    // workers == 0 means one per CPU
+    explicit Executor(unsigned workers = 0);
+
+    Executor(const Executor &) = delete;
+
+    Executor &operator=(const Executor &) = delete;
+
+    ~Executor();
+
+    void spawn(Task task);
+
+    // co_await executor.ready(fd, EPOLLIN) resumes once fd is readable
+    // (or EPOLLOUT writable), hung up or in error.
+    auto ready(int fd, uint32_t events) {
+        struct Awaiter {
+            Executor &executor;
+            int fd;
+            uint32_t events;
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> h) { executor.watch(fd, events, h); }
+
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{*this, fd, events};
+    }
+
+    // co_await executor.sleep_for(delay) resumes once the delay passed.
+    auto sleep_for(std::chrono::nanoseconds delay) {
+        struct Awaiter {
+            Executor &executor;
+            std::chrono::nanoseconds delay;
+            int timer_fd = -1;
+
+            bool await_ready() const noexcept { return delay.count() <= 0; }
+
+            void await_suspend(std::coroutine_handle<> h) { executor.watch_timer(delay, timer_fd, h); }
+
+            void await_resume() const noexcept { executor.close_timer(timer_fd); }
+        };
+        return Awaiter{*this, delay};
+    }
+
+    // co_await executor.yield() lets the other queued coroutines run first.
+    auto yield() {
+        struct Awaiter {
+            Executor &executor;
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> h) { executor.schedule(h); }
+
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{*this};
+    }
+
+private:
+    struct Worker {
+        std::mutex mtx;
+        std::deque<std::coroutine_handle<>> queue;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next_worker{0};
+
+    std::mutex sleep_mutex;
+    std::condition_variable work_available;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> sleepers{0};
+    std::atomic<bool> stopping{false};
+
+    int epoll_fd = -1;
+    int stop_fd = -1; // eventfd that wakes the reactor for shutdown
+    std::thread reactor;
+
+    void schedule(std::coroutine_handle<> h);
+
+    void watch(int fd, uint32_t events, std::coroutine_handle<> h);
+
+    void watch_timer(std::chrono::nanoseconds delay, int &timer_fd, std::coroutine_handle<> h);
+
+    static void close_timer(int timer_fd);
+
+    std::coroutine_handle<> take(size_t self);
+
+    void run_worker(size_t self);
+
+    void run_reactor();
+};
+
+#endif // EXECUTOR_HPP
@@ -1,17 +1,36 @@
 // This file contains I/O functions.
-// There should be no need to modify this file.
 
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "decoder.hpp"
 #include "io.hpp"
+#include "shmring.hpp"
 
 // out of line definitions for the mutexes in SyncCerr/SyncCout
 std::mutex SyncCerr::mut;
 std::mutex SyncCout::mut;
 
+// how long a parked consumer sleeps before checking that the client is still there
+static constexpr long ring_liveness_timeout_ns = 100'000'000;
+// how many empty polls a spinning consumer does between liveness checks
+static constexpr uint32_t ring_liveness_spin_rounds = 4096;
+
 void ClientConnection::freeHandle()
 {
+	if(m_ring != nullptr)
+	{
+		munmap(m_ring, sizeof(ShmRing));
+		m_ring = nullptr;
+	}
 	if(m_handle != -1)
 	{
 		close(m_handle);
@@ -19,17 +38,109 @@ void ClientConnection::freeHandle()
 	}
 }
 
-ReadResult ClientConnection::readInput(ClientCommand& read_into)
+ReadResult ClientConnection::readCommands(CommandBatch& batch, bool wait, size_t max)
 {
-	switch(read(m_handle, &read_into, sizeof(ClientCommand)))
+	batch.size = 0;
+	max = std::min(std::max<size_t>(max, 1), CommandBatch::capacity);
+	if(m_ring != nullptr)
+		return this->readRing(batch, max);
+
+	// carry over the bytes of a command cut short by the previous read
+	char* buffer = reinterpret_cast<char*>(batch.commands);
+	std::memcpy(buffer, m_partial, m_partial_size);
+
+	char control[CMSG_SPACE(sizeof(int))] {};
+	struct iovec iov { buffer + m_partial_size, max * sizeof(ClientCommand) - m_partial_size };
+	struct msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t received = recvmsg(m_handle, &msg, MSG_CMSG_CLOEXEC | (wait ? 0 : MSG_DONTWAIT));
+	if(received == 0)
+		return ReadResult::EndOfFile;
+	if(received < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) && !wait ? ReadResult::WouldBlock : ReadResult::Error;
+
+	int fd = -1;
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	size_t total = m_partial_size + static_cast<size_t>(received);
+	size_t n = total / sizeof(ClientCommand);
+	m_partial_size = total % sizeof(ClientCommand);
+	std::memcpy(m_partial, buffer + n * sizeof(ClientCommand), m_partial_size);
+
+	// the handshake is the only thing a ring client ever sends on the socket
+	if(n > 0 && batch.commands[0].type == input_shm_attach)
 	{
-		case 0: //
-			return ReadResult::EndOfFile;
+		if(fd == -1 || n != 1 || m_partial_size != 0 || !this->attachRing(fd))
+			return ReadResult::Error;
+		return wait ? this->readRing(batch, max) : ReadResult::Success;
+	}
+	if(fd != -1)
+		close(fd);
 
-		case sizeof(ClientCommand): //
+	batch.size = decode_commands(batch.commands, n, batch.rejected);
+	return ReadResult::Success;
+}
+
+bool ClientConnection::attachRing(int fd)
+{
+	struct stat st {};
+	if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ShmRing))
+	{
+		close(fd);
+		return false;
+	}
+
+	void* mem = mmap(nullptr, sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED)
+		return false;
+
+	m_ring = static_cast<ShmRing*>(mem);
+	return m_ring->magic == ShmRing::magic_value;
+}
+
+ReadResult ClientConnection::readRing(CommandBatch& batch, size_t max)
+{
+	uint32_t rounds = 0;
+	while(true)
+	{
+		size_t n = 0;
+		while(n < max && m_ring->try_pop(batch.commands[n]))
+			n++;
+		if(n > 0)
+		{
+			batch.size = decode_commands(batch.commands, n, batch.rejected);
 			return ReadResult::Success;
+		}
 
-		default: //
-			return ReadResult::Error;
+		// the producer closes only after its last push, so closed + empty means drained
+		if(m_ring->closed.load(std::memory_order_acquire) && m_ring->empty())
+			return ReadResult::EndOfFile;
+
+		if(m_ring->wait_readable(ring_liveness_timeout_ns))
+			continue;
+
+		if(m_ring->wait_mode == ShmWaitMode::Spin && ++rounds % ring_liveness_spin_rounds != 0)
+			continue;
+
+		// a client that died without closing the ring still leaves a hung up socket
+		if(this->peerClosed() && m_ring->empty())
+			return ReadResult::EndOfFile;
 	}
 }
+
+bool ClientConnection::peerClosed()
+{
+	struct pollfd pfd {};
+	pfd.fd = m_handle;
+	pfd.events = POLLRDHUP;
+	if(poll(&pfd, 1, 0) == -1)
+		return true;
+	return pfd.revents & (POLLHUP | POLLRDHUP | POLLERR);
+}
@@ -1,9 +1,12 @@
 // This file contains definitions used by the provided I/O code.
-// There should be no need to modify this file.
 
 #pragma once
 
+#include <charconv>
+#include <cstring>
 #include <mutex>
+#include <string>
+#include <type_traits>
 #include <utility>
 #include <cstdint>
 #include <iostream>
@@ -12,7 +15,12 @@ enum CommandType
 {
 	input_buy = 'B',
 	input_sell = 'S',
-	input_cancel = 'C'
+	input_cancel = 'C',
+	input_mass_cancel = 'M',
+	input_time_to_live = 'T', // count: milliseconds later orders of the session rest at most, 0 for no limit
+	input_iceberg = 'I', // count: quantity later orders of the session display at a time, 0 to display all
+	// transport handshake, consumed by ClientConnection and never handed to the engine
+	input_shm_attach = 'R'
 };
 
 struct ClientCommand
@@ -28,15 +36,37 @@ enum class ReadResult
 {
 	Success,
 	EndOfFile,
-	Error
+	Error,
+	WouldBlock // only from a non-blocking read
 };
 
+struct ShmRing;
+
+// Commands decoded from one read of a connection, malformed ones dropped.
+struct CommandBatch
+{
+	static constexpr size_t capacity = 256;
+
+	ClientCommand commands[capacity];
+	size_t size = 0;
+	size_t rejected = 0;
+};
+
+// A client either streams commands over its socket, or sends a single
+// input_shm_attach command carrying a memfd (SCM_RIGHTS) and from then on
+// pushes commands into the shared ShmRing; the socket is then only used
+// to detect that the client went away.
 struct ClientConnection
 {
 	~ClientConnection() { this->freeHandle(); }
 	explicit ClientConnection(int handle) : m_handle(handle) { }
 
-	ClientConnection(ClientConnection&& other) : m_handle(std::exchange(other.m_handle, -1)) { }
+	ClientConnection(ClientConnection&& other)
+	    : m_handle(std::exchange(other.m_handle, -1)), m_ring(std::exchange(other.m_ring, nullptr)),
+	      m_partial_size(std::exchange(other.m_partial_size, 0))
+	{
+		std::memcpy(m_partial, other.m_partial, sizeof(m_partial));
+	}
 	ClientConnection& operator=(ClientConnection&& other)
 	{
 		if(&other == this)
@@ -44,6 +74,9 @@ struct ClientConnection
 
 		this->freeHandle();
 		m_handle = std::exchange(other.m_handle, -1);
+		m_ring = std::exchange(other.m_ring, nullptr);
+		m_partial_size = std::exchange(other.m_partial_size, 0);
+		std::memcpy(m_partial, other.m_partial, sizeof(m_partial));
 
 		return *this;
 	}
@@ -51,11 +84,29 @@ struct ClientConnection
 	ClientConnection(const ClientConnection&) = delete;
 	ClientConnection& operator=(const ClientConnection&) = delete;
 
-	ReadResult readInput(ClientCommand& read_into);
+	// Blocks until at least one command arrived, then reads everything that
+	// is available, up to the batch's capacity, and decodes it in one go.
+	// The batch may still come back empty if all of it was malformed.
+	// With wait == false a socket without data gives WouldBlock instead, and
+	// the shm handshake returns an empty batch; the ring itself can only be
+	// read blocking. At most max commands are taken, the rest stays queued
+	// in the socket or ring.
+	ReadResult readCommands(CommandBatch& batch, bool wait = true, size_t max = CommandBatch::capacity);
+
+	int handle() const { return m_handle; }
+	bool usesRing() const { return m_ring != nullptr; }
 
 private:
 	int m_handle;
+	ShmRing* m_ring = nullptr;
+	// the start of a command whose remaining bytes have not arrived yet
+	char m_partial[sizeof(ClientCommand)];
+	size_t m_partial_size = 0;
 	void freeHandle();
+
+	bool attachRing(int fd);
+	ReadResult readRing(CommandBatch& batch, size_t max);
+	bool peerClosed();
 };
 
 // An implementation of std::osyncstream{std::cout}
@@ -100,9 +151,108 @@ struct SyncCerr
 	}
 };
 
+// Collects output text with std::to_chars instead of ostream formatting, so
+// a block of lines reaches std::cout in a single write.
+struct LineBuffer
+{
+	std::string text;
+
+	LineBuffer& operator<<(const char* s)
+	{
+		text.append(s);
+		return *this;
+	}
+
+	LineBuffer& operator<<(char c)
+	{
+		text.push_back(c);
+		return *this;
+	}
+
+	template <typename T>
+	    requires std::is_integral_v<T>
+	LineBuffer& operator<<(T v)
+	{
+		char digits[24];
+		auto result = std::to_chars(digits, digits + sizeof(digits), v);
+		text.append(digits, result.ptr);
+		return *this;
+	}
+};
+
+// One output line, recorded while locks are held and written later.
+struct OutputEvent
+{
+	enum Kind : uint8_t
+	{
+		Added,
+		Executed,
+		Deleted,
+		LevelSummary, // all executions of one incoming order at one price
+		Rejected,     // a new order turned away by a resting order limit
+		Reduced       // self-trade prevention lowered a resting and an incoming order without executing
+	};
+
+	Kind kind;
+	bool flag;             // Added: is_sell_side, Deleted: cancel_accepted
+	uint32_t id;           // Executed, Reduced: resting id, LevelSummary: new id
+	uint32_t other_id;     // Executed, Reduced: new id
+	uint32_t execution_id; // Executed: execution id, LevelSummary: number of executions
+	uint32_t price;
+	uint32_t count;        // Reduced: by how much, on both
+	char symbol[9];        // Added, copied so the event outlives the command
+	intmax_t timestamp;
+};
+
 class Output
 {
 public:
+	// Line number of the sequenced output across the whole engine, only
+	// touched with SyncCout::mut held.
+	inline static uint64_t global_sequence = 0;
+
+	// Writes the events as one contiguous block, flushed once. With a stream
+	// name every line is prefixed with '<global seq> <stream> <stream seq>',
+	// the stream's numbers counting up from first_sequence.
+	inline static void Publish(const OutputEvent* events, size_t n, const char* stream = nullptr, uint64_t first_sequence = 0)
+	{
+		thread_local LineBuffer out;
+		out.text.clear();
+		std::scoped_lock<std::mutex> lock { SyncCout::mut };
+		for(size_t i = 0; i < n; i++)
+		{
+			const OutputEvent& e = events[i];
+			if(stream != nullptr)
+				out << ++global_sequence << " " << stream << " " << first_sequence + i << " ";
+			switch(e.kind)
+			{
+				case OutputEvent::Added:
+					out << (e.flag ? "S " : "B ") << e.id << " " << e.symbol << " " << e.price << " " << e.count << " "
+					    << e.timestamp << '\n';
+					break;
+				case OutputEvent::Executed:
+					out << "E " << e.id << " " << e.other_id << " " << e.execution_id << " " << e.price << " "
+					    << e.count << " " << e.timestamp << '\n';
+					break;
+				case OutputEvent::Deleted:
+					out << "X " << e.id << " " << (e.flag ? "A " : "R ") << e.timestamp << '\n';
+					break;
+				case OutputEvent::LevelSummary:
+					out << "L " << e.id << " " << e.price << " " << e.count << " " << e.execution_id << " "
+					    << e.timestamp << '\n';
+					break;
+				case OutputEvent::Rejected:
+					out << "R " << e.id << " " << e.timestamp << '\n';
+					break;
+				case OutputEvent::Reduced:
+					out << "D " << e.id << " " << e.other_id << " " << e.count << " " << e.timestamp << '\n';
+					break;
+			}
+		}
+		std::cout.write(out.text.data(), out.text.size());
+		std::cout.flush();
+	}
+
 	inline static void
 	OrderAdded(uint32_t id, const char* symbol, uint32_t price, uint32_t count, bool is_sell_side, intmax_t output_timestamp)
 	{
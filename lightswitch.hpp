@@ -2,36 +2,54 @@
 #define _LIGHTSWITCH_H
 
 #include <mutex>
+#include "adaptivemutex.hpp"
 #include "engine.hpp"
 
+// The counter lock is held for an increment. The side lock is handed from
+// the first thread of a side to the last one, possibly a different thread,
+// which AdaptiveMutex allows; STD_LOCKS restores the old std::mutex locks
+// for comparison.
+#ifdef STD_LOCKS
+typedef std::mutex SwitchCounterMutex;
+typedef std::mutex SideMutex;
+#else
+typedef AdaptiveMutex SwitchCounterMutex;
+typedef AdaptiveMutex SideMutex;
+#endif
+
 struct LightSwitch {
 private:
-    std::mutex lightswitch_mutex;
+    SwitchCounterMutex lightswitch_mutex;
     int counter = 0;
 
 public:
-    void lock(std::mutex &m) {
-        std::lock_guard<std::mutex> guard(lightswitch_mutex);
+    void lock(SideMutex &m) {
+        std::lock_guard<SwitchCounterMutex> guard(lightswitch_mutex);
         counter++;
         if (counter == 1) {
             m.lock();
         }
     }
 
-    void unlock(std::mutex &m) {
-        std::lock_guard<std::mutex> guard(lightswitch_mutex);
+    void unlock(SideMutex &m) {
+        std::lock_guard<SwitchCounterMutex> guard(lightswitch_mutex);
         counter--;
         if (counter == 0) {
             m.unlock();
         }
     }
 
+#ifdef LOCK_STATS
+    void count_into(LockStats &stats) {
+        lightswitch_mutex.count_into(stats);
+    }
+#endif
 };
 
 struct LightSwitches {
     LightSwitch buy_lightswitch;
     LightSwitch sell_lightswitch;
-    std::mutex shared_m;
+    SideMutex shared_m;
 };
 
 #endif // _LIGHTSWITCH_H
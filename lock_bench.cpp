@@ -0,0 +1,168 @@
+// Contended lock benchmarks: a bare critical section under std::mutex and
+// AdaptiveMutex, then the whole engine with every client thread trading the
+// same few symbols, like scripts/four-threads.in. The engine part measures
+// whichever lock types the engine was built with (see STD_LOCKS).
+
+#include <getopt.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "adaptivemutex.hpp"
+#include "engine.hpp"
+
+struct BenchConfig {
+    unsigned threads = 4;
+    unsigned long ops = 200000;
+    unsigned symbols = 1;
+    unsigned work = 8; // loop iterations inside the bare critical section
+};
+
+template<typename F>
+static double timed(unsigned threads, F body) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back(body, t);
+    }
+    for (auto &w: workers) {
+        w.join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<typename Mutex>
+static void bench_lock(const char *name, const BenchConfig &cfg) {
+    Mutex m;
+    volatile uint64_t shared = 0;
+
+    double elapsed = timed(cfg.threads, [&](unsigned) {
+        for (unsigned long i = 0; i < cfg.ops; ++i) {
+            std::lock_guard<Mutex> guard(m);
+            for (unsigned w = 0; w < cfg.work; ++w) {
+                shared = shared + 1;
+            }
+        }
+    });
+
+    unsigned long total = cfg.ops * cfg.threads;
+    printf("%-14s %8.1f ns/lock  %10.0f locks/s", name, elapsed * 1e9 / total, total / elapsed);
+#ifdef LOCK_STATS
+    if constexpr (std::is_same_v<Mutex, AdaptiveMutex>) {
+        const LockStats &s = m.stats();
+        printf("  contended %.1f%%, spun %llu, parked %llu", 100.0 * s.contended / s.acquisitions,
+               static_cast<unsigned long long>(s.spun), static_cast<unsigned long long>(s.parked));
+    }
+#endif
+    printf("\n");
+}
+
+// Every thread is its own session placing orders around one price, so
+// sweeps, inserts and cancels keep colliding on the same books and orders.
+static void bench_engine(const BenchConfig &cfg) {
+    Engine engine;
+    std::cout.setstate(std::ios::badbit);
+
+    double elapsed = timed(cfg.threads, [&](unsigned t) {
+        auto session = engine.open_session();
+        std::mt19937 rng(t + 1);
+        std::vector<uint32_t> mine;
+        for (unsigned long i = 0; i < cfg.ops; ++i) {
+            ClientCommand cmd{};
+            if (!mine.empty() && rng() % 4 == 0) {
+                cmd.type = input_cancel;
+                cmd.order_id = mine[rng() % mine.size()];
+            } else {
+                cmd.type = rng() % 2 ? input_buy : input_sell;
+                cmd.order_id = static_cast<uint32_t>(i * cfg.threads + t + 1);
+                cmd.price = 100 + rng() % 7;
+                cmd.count = 1 + rng() % 20;
+                unsigned symbol = static_cast<unsigned>(rng() % cfg.symbols % 100000);
+                snprintf(cmd.instrument, sizeof(cmd.instrument), "SYM%u", symbol);
+                mine.push_back(cmd.order_id);
+            }
+            engine.handle(session, cmd);
+        }
+    });
+
+    std::cout.clear();
+    unsigned long total = cfg.ops * cfg.threads;
+    printf("%-14s %8.1f ns/cmd   %10.0f commands/s\n", "engine", elapsed * 1e9 / total, total / elapsed);
+#ifdef LOCK_STATS
+    // the lock lines of the engine's metrics, one per symbol
+    std::ostringstream metrics;
+    std::streambuf *original = std::cerr.rdbuf(metrics.rdbuf());
+    engine.report_metrics();
+    std::cerr.rdbuf(original);
+    std::istringstream lines(metrics.str());
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, 14, "metrics locks ") == 0) {
+            printf("  %s\n", line.c_str() + 8);
+        }
+    }
+#endif
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [--threads=<n>] [--ops=<n>] [--symbols=<n>] [--work=<n>]\n"
+            "  --threads=<n>  contending threads (default 4)\n"
+            "  --ops=<n>      locks or commands per thread (default 200000)\n"
+            "  --symbols=<n>  symbols the engine threads spread over (default 1)\n"
+            "  --work=<n>     size of the bare critical section (default 8)\n",
+            argv0);
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig cfg;
+
+    static const struct option long_options[] = {
+            {"threads", required_argument, nullptr, 't'},
+            {"ops",     required_argument, nullptr, 'o'},
+            {"symbols", required_argument, nullptr, 's'},
+            {"work",    required_argument, nullptr, 'w'},
+            {nullptr, 0,                   nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 't':
+                cfg.threads = static_cast<unsigned>(strtoul(optarg, nullptr, 10));
+                break;
+            case 'o':
+                cfg.ops = strtoul(optarg, nullptr, 10);
+                break;
+            case 's':
+                cfg.symbols = static_cast<unsigned>(strtoul(optarg, nullptr, 10));
+                break;
+            case 'w':
+                cfg.work = static_cast<unsigned>(strtoul(optarg, nullptr, 10));
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (cfg.threads == 0 || cfg.symbols == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%u threads, %lu ops each, %u CPUs\n", cfg.threads, cfg.ops, std::thread::hardware_concurrency());
+    bench_lock<std::mutex>("std::mutex", cfg);
+    bench_lock<AdaptiveMutex>("AdaptiveMutex", cfg);
+    bench_engine(cfg);
+    return 0;
+}
@@ -1,6 +1,6 @@
 // This file contains main() as well as the logic setting up the I/O.
-// There should be no need to modify this file.
 
+#include <getopt.h>
 #include <stdio.h>
 #include <signal.h>
 #include <stddef.h>
@@ -10,11 +10,15 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <thread>
+
 #include "io.hpp"
 #include "engine.hpp"
 
 static int listenfd = -1;
 static char* socketpath = NULL;
+static int querylistenfd = -1;
+static char* querysocketpath = NULL;
 
 static void handle_exit_signal(int signum)
 {
@@ -24,6 +28,12 @@ static void handle_exit_signal(int signum)
 
 static void exit_cleanup(void)
 {
+	if(querylistenfd != -1)
+	{
+		close(querylistenfd);
+		unlink(querysocketpath);
+	}
+
 	if(listenfd == -1)
 		return;
 
@@ -32,33 +42,242 @@ static void exit_cleanup(void)
 		unlink(socketpath);
 }
 
-int main(int argc, char* argv[])
+static void usage(const char* argv0)
 {
-	if(argc < 2)
+	fprintf(stderr,
+	    "Usage: %s [options] <socket path>\n"
+	    "  --stp=none|cancel-resting|cancel-incoming|decrement-both\n"
+	    "      self-trade prevention between orders of the same connection (default none); a\n"
+	    "      cancelled incoming remainder is answered with 'R <id> <time>', a decrement with\n"
+	    "      'D <resting id> <incoming id> <count> <time>'\n"
+	    "  --cancel-on-disconnect\n"
+	    "      cancel all resting orders of a connection when it closes\n"
+	    "  --level-summary\n"
+	    "      after the executions of a sweep, print 'L <id> <price> <count> <executions> <time>' per price\n"
+	    "  --sequenced\n"
+	    "      prefix every line with '<global seq> <symbol> <symbol seq>', see the validate tool\n"
+	    "  --workers=<n>\n"
+	    "      run the connections on n executor threads (default one per CPU)\n"
+	    "  --thread-per-connection\n"
+	    "      give every connection a blocking thread of its own instead\n"
+	    "  --symbols=<file>\n"
+	    "      create the listed symbols at startup, one '<symbol> [expected depth]' per line\n"
+	    "  --max-symbol-orders=<n>, --max-symbol-bytes=<n>\n"
+	    "  --max-session-orders=<n>, --max-session-bytes=<n>\n"
+	    "      reject new orders with 'R <id> <time>' while the symbol or connection has this\n"
+	    "      many open orders, or open orders using this many bytes (default no limit)\n"
+	    "  --metrics-interval=<seconds>\n"
+	    "      print the memory accounting per symbol and connection to stderr this often,\n"
+	    "      and the lock contention per symbol when built with CPPFLAGS=-DLOCK_STATS\n"
+	    "  --auction=<symbol>[,<symbol>...]\n"
+	    "      trade these symbols in call auctions: orders rest unmatched until the book is\n"
+	    "      crossed at one price every --auction-interval=<ms> (default 10), or after\n"
+	    "      --auction-orders=<n> new orders; an interval of 0 turns the timer off and needs\n"
+	    "      --auction-orders\n"
+	    "  --query=<socket path>\n"
+	    "      answer 'top <symbol> [<levels>]', 'depth <symbol>' and 'order <symbol> <id>' lines\n"
+	    "      on this socket from copies of the books, without locking them\n"
+	    "  --session-quantum=<n>\n"
+	    "      commands a connection may handle per turn before the others get theirs (default 64)\n"
+	    "  --session-rate=<n>, --session-burst=<n>\n"
+	    "      limit every connection to n commands a second, in bursts of up to the given number\n"
+	    "      (default no limit, bursts of a tenth of a second's worth)\n",
+	    argv0);
+}
+
+static void report_metrics(Engine* engine, unsigned interval)
+{
+	while(true)
 	{
-		fprintf(stderr, "Usage: %s <socket path>\n", argv[0]);
-		return 1;
+		sleep(interval);
+		engine->report_metrics();
 	}
+}
 
-	socketpath = argv[1];
-	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if(listenfd == -1)
+static void parse_auction_symbols(char* list, EngineConfig& config)
+{
+	for(char* symbol = strtok(list, ","); symbol != NULL; symbol = strtok(NULL, ","))
+		config.auction_symbols.emplace_back(symbol, strnlen(symbol, 8));
+}
+
+static int listen_on(const char* path)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1)
 	{
 		perror("socket");
-		return 1;
+		return -1;
 	}
 
+	struct sockaddr_un sockaddr {};
+	sockaddr.sun_family = AF_UNIX;
+	strncpy(sockaddr.sun_path, path, sizeof(sockaddr.sun_path) - 1);
+	if(bind(fd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
 	{
-		struct sockaddr_un sockaddr {};
-		sockaddr.sun_family = AF_UNIX;
-		strncpy(sockaddr.sun_path, argv[1], sizeof(sockaddr.sun_path) - 1);
-		if(bind(listenfd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// One query per line, answered in order until the client hangs up.
+static void serve_queries(Engine* engine, int fd)
+{
+	FILE* in = fdopen(fd, "r");
+	if(in == NULL)
+	{
+		close(fd);
+		return;
+	}
+
+	char* line = NULL;
+	size_t line_size = 0;
+	while(getline(&line, &line_size, in) != -1)
+	{
+		std::string answer = engine->query(line);
+		if(write(fd, answer.data(), answer.size()) != (ssize_t) answer.size())
+			break;
+	}
+
+	free(line);
+	fclose(in);
+}
+
+static void accept_queries(Engine* engine)
+{
+	while(true)
+	{
+		int connfd = accept(querylistenfd, NULL, NULL);
+		if(connfd == -1)
 		{
-			perror("bind");
-			return 1;
+			perror("accept");
+			return;
+		}
+		std::thread(serve_queries, engine, connfd).detach();
+	}
+}
+
+static const uint32_t default_expected_depth = 1024;
+
+static bool load_symbols(const char* path, EngineConfig& config)
+{
+	FILE* file = fopen(path, "r");
+	if(file == NULL)
+	{
+		perror(path);
+		return false;
+	}
+
+	char* line = NULL;
+	size_t line_size = 0;
+	bool ok = true;
+	while(getline(&line, &line_size, file) != -1)
+	{
+		if(line[0] == '#' || line[0] == '\n')
+			continue;
+
+		char symbol[9] {};
+		uint32_t depth = default_expected_depth;
+		if(sscanf(line, "%8s %u", symbol, &depth) < 1)
+		{
+			fprintf(stderr, "Invalid symbol line: %s", line);
+			ok = false;
+			break;
+		}
+		config.symbols.emplace_back(symbol, depth);
+	}
+
+	free(line);
+	fclose(file);
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	EngineConfig config {};
+	unsigned metrics_interval = 0;
+
+	static const struct option long_options[] = {
+		{ "stp", required_argument, NULL, 'p' },
+		{ "cancel-on-disconnect", no_argument, NULL, 'd' },
+		{ "symbols", required_argument, NULL, 'y' },
+		{ "level-summary", no_argument, NULL, 'l' },
+		{ "sequenced", no_argument, NULL, 'q' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "thread-per-connection", no_argument, NULL, 't' },
+		{ "max-symbol-orders", required_argument, NULL, 'o' },
+		{ "max-symbol-bytes", required_argument, NULL, 'b' },
+		{ "max-session-orders", required_argument, NULL, 'O' },
+		{ "max-session-bytes", required_argument, NULL, 'B' },
+		{ "metrics-interval", required_argument, NULL, 'm' },
+		{ "auction", required_argument, NULL, 'a' },
+		{ "auction-interval", required_argument, NULL, 'i' },
+		{ "auction-orders", required_argument, NULL, 'n' },
+		{ "query", required_argument, NULL, 'Q' },
+		{ "session-quantum", required_argument, NULL, 'u' },
+		{ "session-rate", required_argument, NULL, 'r' },
+		{ "session-burst", required_argument, NULL, 'e' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	int opt;
+	while((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'p':
+				if(!parse_self_trade_prevention(optarg, config.stp))
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'd': config.cancel_on_disconnect = true; break;
+			case 'l': config.level_summary = true; break;
+			case 'q': config.sequenced = true; break;
+			case 'w': config.workers = (unsigned) strtoul(optarg, NULL, 10); break;
+			case 't': config.thread_per_connection = true; break;
+			case 'o': config.max_symbol_orders = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'b': config.max_symbol_bytes = strtoull(optarg, NULL, 10); break;
+			case 'O': config.max_session_orders = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'B': config.max_session_bytes = strtoull(optarg, NULL, 10); break;
+			case 'm': metrics_interval = (unsigned) strtoul(optarg, NULL, 10); break;
+			case 'a': parse_auction_symbols(optarg, config); break;
+			case 'i': config.auction_interval_ms = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'n': config.auction_orders = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'u': config.session_quantum = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'r': config.session_rate = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'e': config.session_burst = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'Q':
+				querysocketpath = optarg;
+				config.book_views = true;
+				break;
+			case 'y':
+				if(!load_symbols(optarg, config))
+					return 1;
+				break;
+			default: usage(argv[0]); return 1;
 		}
 	}
 
+	if(!config.auction_symbols.empty() && config.auction_interval_ms == 0 && config.auction_orders == 0)
+	{
+		fprintf(stderr, "--auction-interval=0 needs --auction-orders=<n>, or the auctions never cross\n");
+		return 1;
+	}
+
+	if(optind >= argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	socketpath = argv[optind];
+	listenfd = listen_on(socketpath);
+	if(listenfd == -1)
+		return 1;
+
 	atexit(exit_cleanup);
 	signal(SIGINT, handle_exit_signal);
 	signal(SIGTERM, handle_exit_signal);
@@ -69,7 +288,24 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	auto engine = new Engine();
+	if(querysocketpath)
+	{
+		querylistenfd = listen_on(querysocketpath);
+		if(querylistenfd == -1)
+			return 1;
+		if(listen(querylistenfd, 8) != 0)
+		{
+			perror("listen");
+			return 1;
+		}
+	}
+
+	auto engine = new Engine(config);
+	if(metrics_interval > 0)
+		std::thread(report_metrics, engine, metrics_interval).detach();
+	if(querylistenfd != -1)
+		std::thread(accept_queries, engine).detach();
+
 	while(true)
 	{
 		int connfd = accept(listenfd, NULL, NULL);
@@ -1,19 +1,28 @@
 #include "order.hpp"
+#include "session.hpp"
 
 Order::Order(uint32_t prc,
              intmax_t t,
              uint32_t cnt,
-             uint32_t id) : price{prc},
-                            timestamp{t},
-                            count{cnt},
-                            order_id{id} {
+             uint32_t id,
+             std::shared_ptr<Session> s,
+             uint32_t disp) : price{prc},
+                              timestamp{t},
+                              count{disp > 0 && disp < cnt ? disp : cnt},
+                              order_id{id},
+                              session_id{s ? s->id : 0},
+                              session{std::move(s)},
+                              display{count < cnt ? disp : 0},
+                              reserve{cnt - count} {
 }
 
 std::ostream &operator<<(std::ostream &os, const Order &o) {
     os << "Order"
        << "  id: " << o.order_id
+       << "  session: " << o.session_id
        << "  price: " << o.price
        << "  quantity: " << o.count
+       << "  reserve: " << o.reserve
        << "  timestamp: " << o.timestamp;
     return os;
 }
\ No newline at end of file
@@ -7,34 +7,87 @@
 #include <mutex>
 #include <ostream>
 
-class Order {
+#include "adaptivemutex.hpp"
+#include "timerwheel.hpp"
+
+struct Session;
+struct Instrument;
+class Order;
+
+typedef TimerWheel<std::shared_ptr<Order>> ExpiryWheel;
+
+// Held for a handful of field updates per match or cancel, so waiters spin
+// before they park. Any Lockable works here.
+#ifdef STD_LOCKS
+typedef std::mutex OrderMutex;
+#else
+typedef AdaptiveMutex OrderMutex;
+#endif
+
+class Order : public std::enable_shared_from_this<Order> {
 public:
     uint32_t price;
-    intmax_t timestamp;
+    intmax_t timestamp; // only reported, the books order by BookEntry::sequence
 
-    mutable uint32_t count;
+    mutable uint32_t count; // displayed quantity
     uint32_t order_id;
+    uint32_t session_id; // connection that placed the order
     mutable uint32_t execution_id = 1;
-    std::mutex order_mutex;
+    OrderMutex order_mutex;
+
+    // owning session and its open-order list links, guarded by the session
+    std::shared_ptr<Session> session;
+    Order *session_prev = nullptr;
+    Order *session_next = nullptr;
+
+    // instrument the order rests on (its sequencer and accounting), set when it is booked
+    Instrument *instrument = nullptr;
 
-    Order(uint32_t price, intmax_t timestamp, uint32_t count, uint32_t order_id);
+    // good-till-time orders: set when booked; the timer is guarded by the
+    // engine's expiry mutex and cleared once it fired or was cancelled
+    bool expires = false;
+    ExpiryWheel::Timer *expiry = nullptr;
+
+    // Iceberg orders show display of their quantity at a time and keep the
+    // rest in reserve, both 0 for plain orders. sequence is that of the
+    // order's live BookEntry; a replenished iceberg leaves dead ones behind.
+    uint32_t display;
+    uint32_t reserve;
+    uint64_t sequence = 0;
+
+    // A display of 0, or not below count, makes a plain order.
+    Order(uint32_t price, intmax_t timestamp, uint32_t count, uint32_t order_id,
+          std::shared_ptr<Session> session = nullptr, uint32_t display = 0);
 };
 
 std::ostream &operator<<(std::ostream &os, const Order &o);
 
+/*
+ * What a book holds per order. Price and insertion sequence are copied out
+ * of the Order so that ordering the book compares two inline integers and
+ * never follows the pointer. The sequence comes from a per-instrument,
+ * per-side counter, so orders at the same price keep exact arrival order
+ * and no two entries are ever equivalent.
+ */
+struct BookEntry {
+    uint32_t price;
+    uint64_t sequence;
+    std::shared_ptr<Order> order;
+};
+
 struct sell_cmp {
-    bool operator()(const std::shared_ptr<Order>& a, const std::shared_ptr<Order>& b) const {
-        if (a->price == b->price)
-            return a->timestamp < b->timestamp;
-        return a->price < b->price;
+    bool operator()(const BookEntry &a, const BookEntry &b) const {
+        if (a.price == b.price)
+            return a.sequence < b.sequence;
+        return a.price < b.price;
     }
 };
 
 struct buy_cmp {
-    bool operator()(const std::shared_ptr<Order>& a, const std::shared_ptr<Order>& b) const {
-        if (a->price == b->price)
-            return a->timestamp < b->timestamp;
-        return a->price > b->price;
+    bool operator()(const BookEntry &a, const BookEntry &b) const {
+        if (a.price == b.price)
+            return a.sequence < b.sequence;
+        return a.price > b.price;
     }
 };
 
@@ -0,0 +1,455 @@
+// Offline replay of the multi-client .in test format straight into Engine,
+// without sockets or threads. The clients of a script are interleaved
+// round robin, or in a random order drawn from a fixed seed, so every run
+// of the same script and seed executes the same sequence of commands.
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "engine.hpp"
+
+struct Step {
+    enum Kind {
+        Open,
+        Close,
+        Command,
+        Barrier,
+        Wait
+    } kind;
+    ClientCommand command{};
+    uint32_t arg = 0; // barrier index, or the order id waited for
+    bool awaited = false; // a new order some client waits for
+};
+
+struct Script {
+    std::vector<std::vector<Step>> clients;
+    std::vector<uint32_t> barriers; // participants of each
+    size_t commands = 0;
+};
+
+// std::cout flushes on every std::endl; this keeps the output in a large
+// buffer and only writes when it is full or at exit.
+class BufferedStdout : public std::streambuf {
+private:
+    std::vector<char> buffer;
+
+    bool drain() {
+        const char *p = pbase();
+        while (p < pptr()) {
+            ssize_t n = write(STDOUT_FILENO, p, pptr() - p);
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+        }
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return true;
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (!drain()) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        return 0;
+    }
+
+public:
+    BufferedStdout() : buffer(1 << 20) {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    ~BufferedStdout() override {
+        drain();
+    }
+};
+
+// Parses thread lists like "0", "0,1" or "0,2,4-7".
+static bool parse_threads(const char *spec, uint32_t n_threads, std::vector<uint32_t> &out) {
+    out.clear();
+    while (*spec != '\0') {
+        char *end;
+        unsigned long first = strtoul(spec, &end, 10);
+        unsigned long last = first;
+        if (end == spec) {
+            return false;
+        }
+        if (*end == '-') {
+            spec = end + 1;
+            last = strtoul(spec, &end, 10);
+            if (end == spec) {
+                return false;
+            }
+        }
+        if (last < first || last >= n_threads) {
+            return false;
+        }
+        for (unsigned long t = first; t <= last; ++t) {
+            out.push_back(static_cast<uint32_t>(t));
+        }
+        if (*end == ',') {
+            ++end;
+        } else if (*end != '\0') {
+            return false;
+        }
+        spec = end;
+    }
+    return !out.empty();
+}
+
+static bool parse_command(const char *line, Step &step) {
+    ClientCommand &input = step.command;
+    step.kind = Step::Command;
+    switch (line[0]) {
+        case 'C':
+            input.type = input_cancel;
+            return sscanf(line + 1, " %u", &input.order_id) == 1;
+        case 'M':
+            input.type = input_mass_cancel;
+            return true;
+        case 'T':
+            input.type = input_time_to_live;
+            return sscanf(line + 1, " %u", &input.count) == 1;
+        case 'I':
+            input.type = input_iceberg;
+            return sscanf(line + 1, " %u", &input.count) == 1;
+        case 'B':
+            input.type = input_buy;
+            break;
+        case 'S':
+            input.type = input_sell;
+            break;
+        default:
+            return false;
+    }
+    if (sscanf(line + 1, " %u %8s %u %u", &input.order_id, input.instrument, &input.price, &input.count) != 4) {
+        return false;
+    }
+    // the same validation a connection applies; a zero price or count is not an order
+    size_t rejected = 0;
+    return decode_commands(&input, 1, rejected) == 1;
+}
+
+static bool parse_script(FILE *in, Script &script) {
+    char *line = nullptr;
+    size_t line_size = 0;
+    uint32_t n_threads = 0;
+    size_t line_no = 0;
+    std::vector<uint32_t> threads;
+    std::unordered_set<uint32_t> awaited;
+    bool ok = true;
+
+    while (ok && getline(&line, &line_size, in) != -1) {
+        ++line_no;
+        char *p = line + strspn(line, " \t");
+        p[strcspn(p, "\r\n")] = '\0';
+        if (*p == '#' || *p == '\0') {
+            continue;
+        }
+
+        if (n_threads == 0) {
+            n_threads = static_cast<uint32_t>(strtoul(p, nullptr, 10));
+            if (n_threads == 0) {
+                ok = false;
+                break;
+            }
+            script.clients.resize(n_threads);
+            continue;
+        }
+
+        // optional thread list prefix, otherwise the line is for every thread
+        threads.clear();
+        if (*p >= '0' && *p <= '9') {
+            char *spec = p;
+            p += strcspn(p, " \t");
+            if (*p != '\0') {
+                *p++ = '\0';
+            }
+            p += strspn(p, " \t");
+            if (!parse_threads(spec, n_threads, threads)) {
+                ok = false;
+                break;
+            }
+        } else {
+            for (uint32_t t = 0; t < n_threads; ++t) {
+                threads.push_back(t);
+            }
+        }
+
+        Step step{};
+        switch (*p) {
+            case 'o':
+                step.kind = Step::Open;
+                break;
+            case 'x':
+                step.kind = Step::Close;
+                break;
+            case 's': // sleeping has no meaning without real time
+                continue;
+            case '.':
+                step.kind = Step::Barrier;
+                step.arg = static_cast<uint32_t>(script.barriers.size());
+                script.barriers.push_back(static_cast<uint32_t>(threads.size()));
+                break;
+            case 'w':
+                step.kind = Step::Wait;
+                ok = sscanf(p + 1, " %u", &step.arg) == 1;
+                break;
+            default:
+                ok = parse_command(p, step);
+                break;
+        }
+        if (!ok) {
+            break;
+        }
+        for (uint32_t t: threads) {
+            script.clients[t].push_back(step);
+            script.commands += step.kind == Step::Command;
+        }
+        if (step.kind == Step::Wait) {
+            awaited.insert(step.arg);
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Invalid script line %zu: %s\n", line_no, line);
+    }
+    free(line);
+
+    // only the orders someone waits for are remembered during the replay
+    if (!awaited.empty()) {
+        for (auto &steps: script.clients) {
+            for (Step &step: steps) {
+                step.awaited = step.kind == Step::Command &&
+                               (step.command.type == input_buy || step.command.type == input_sell) &&
+                               awaited.count(step.command.order_id) != 0;
+            }
+        }
+    }
+    return ok && n_threads > 0;
+}
+
+// Where one client of the script is in a replay.
+struct Client {
+    const std::vector<Step> &steps;
+    size_t next = 0;
+    bool at_barrier = false;
+    std::shared_ptr<Session> session;
+};
+
+class Replayer {
+private:
+    Engine &engine;
+    const Script &script;
+    std::vector<Client> clients;
+    std::vector<uint32_t> arrived; // per barrier
+    std::unordered_set<uint32_t> processed;
+
+    bool runnable(Client &c) {
+        if (c.next == c.steps.size()) {
+            return false;
+        }
+        const Step &step = c.steps[c.next];
+        switch (step.kind) {
+            case Step::Barrier: {
+                if (!c.at_barrier) {
+                    c.at_barrier = true;
+                    ++arrived[step.arg];
+                }
+                return arrived[step.arg] == script.barriers[step.arg];
+            }
+            case Step::Wait:
+                return processed.count(step.arg) != 0;
+            default:
+                return true;
+        }
+    }
+
+    void run_step(Client &c) {
+        const Step &step = c.steps[c.next++];
+        c.at_barrier = false;
+        switch (step.kind) {
+            case Step::Open:
+                c.session = engine.open_session();
+                break;
+            case Step::Close:
+                if (c.session) {
+                    engine.close_session(*c.session);
+                    c.session.reset();
+                }
+                break;
+            case Step::Command:
+                if (!c.session) {
+                    c.session = engine.open_session();
+                }
+                engine.handle(c.session, step.command);
+                if (step.awaited) {
+                    processed.insert(step.command.order_id);
+                }
+                break;
+            case Step::Barrier:
+            case Step::Wait:
+                break;
+        }
+    }
+
+public:
+    Replayer(Engine &engine, const Script &script) : engine{engine}, script{script}, arrived(script.barriers.size()) {
+        clients.reserve(script.clients.size());
+        for (const auto &steps: script.clients) {
+            clients.push_back({steps, 0, false, nullptr});
+        }
+    }
+
+    // Returns false if every remaining client is blocked for good.
+    bool run(bool shuffle, uint64_t seed) {
+        std::mt19937_64 rng(seed);
+        const size_t n = clients.size();
+        size_t cursor = 0;
+
+        while (true) {
+            // round robin resumes after the last client, shuffle from a random one;
+            // either way the first runnable client from there takes one step
+            size_t start = shuffle ? rng() % n : cursor;
+            size_t i = 0;
+            for (; i < n; ++i) {
+                size_t t = (start + i) % n;
+                if (runnable(clients[t])) {
+                    run_step(clients[t]);
+                    cursor = t + 1;
+                    break;
+                }
+            }
+            if (i == n) {
+                break;
+            }
+        }
+
+        for (const auto &c: clients) {
+            if (c.next != c.steps.size()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [--seed=<n>] [--repeat=<n>] [--quiet] [--sequenced] [--stp=<mode>] [<test.in>]\n"
+            "  --seed=<n>    interleave clients randomly from this seed (default: round robin)\n"
+            "  --repeat=<n>  replay the script n times, each on a fresh engine\n"
+            "  --quiet       drop the engine output\n"
+            "  --sequenced   number the output like the engine's --sequenced\n"
+            "  --stp=<mode>  self-trade prevention between the orders of one client, as the engine's --stp\n",
+            argv0);
+}
+
+int main(int argc, char *argv[]) {
+    bool shuffle = false;
+    uint64_t seed = 0;
+    unsigned long repeat = 1;
+    bool quiet = false;
+    EngineConfig config;
+
+    static const struct option long_options[] = {
+            {"seed",   required_argument, nullptr, 's'},
+            {"repeat", required_argument, nullptr, 'r'},
+            {"quiet",  no_argument,       nullptr, 'q'},
+            {"sequenced", no_argument,    nullptr, 'n'},
+            {"stp",    required_argument, nullptr, 'p'},
+            {nullptr, 0,                  nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 's':
+                shuffle = true;
+                seed = strtoull(optarg, nullptr, 10);
+                break;
+            case 'r':
+                repeat = strtoul(optarg, nullptr, 10);
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            case 'n':
+                config.sequenced = true;
+                break;
+            case 'p':
+                if (!parse_self_trade_prevention(optarg, config.stp)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    FILE *in = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        in = fopen(argv[optind], "r");
+        if (in == nullptr) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+
+    Script script;
+    if (!parse_script(in, script)) {
+        return 1;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    BufferedStdout out;
+    std::streambuf *original = std::cout.rdbuf(&out);
+    if (quiet) {
+        std::cout.setstate(std::ios::badbit);
+    }
+
+    bool ok = true;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; ok && i < repeat; ++i) {
+        auto engine = std::make_unique<Engine>(config);
+        ok = Replayer(*engine, script).run(shuffle, seed);
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout.clear();
+    std::cout.flush();
+    std::cout.rdbuf(original);
+
+    if (!ok) {
+        fprintf(stderr, "Replay stuck: remaining clients wait on barriers or orders that never come\n");
+        return 1;
+    }
+
+    size_t total = script.commands * repeat;
+    fprintf(stderr, "replayed %zu commands in %.3f s (%.0f commands/s)\n", total, elapsed, total / elapsed);
+    return 0;
+}
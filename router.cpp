@@ -0,0 +1,509 @@
+// This file contains the symbol router. It starts a number of engine
+// processes, each owning the symbols that hash to it, accepts clients on
+// the engine's own socket protocol, forwards every command to the engine
+// that owns its symbol and merges the engines' output into its own.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "decoder.hpp"
+#include "io.hpp"
+#include "safemap.hpp"
+#include "shmring.hpp"
+
+static const unsigned max_partitions = 64;
+
+static int listenfd = -1;
+static char* socketpath = NULL;
+
+static unsigned partitions = 2;
+static std::string partition_paths[max_partitions];
+static pid_t engine_pids[max_partitions];
+static unsigned engines_started = 0;
+static std::atomic<bool> exiting { false };
+
+// How commands travel to the engines: a shared memory ring per client and
+// engine (the default), parked on a futex or busy-polled, or the socket.
+enum class Link { Socket, Shm, ShmSpin };
+static Link partition_link = Link::Shm;
+
+// The engines number their lines with --sequenced, each on its own, so the
+// merged output is numbered again.
+static bool sequenced = false;
+static std::mutex output_mutex;
+static uint64_t global_sequence = 0;  // guarded by output_mutex
+static uint64_t unknown_sequence = 0; // lines of the '-' stream, guarded by output_mutex
+
+// The partition of every order the router forwarded. Entries are never
+// changed or erased, like the engine's own cancelable orders: a cancel can
+// overtake the order it cancels, so the first one need not be the last.
+static SafeMap<uint32_t, uint8_t> order_partitions;
+
+static void handle_exit_signal(int signum)
+{
+	(void) signum;
+	exit(0);
+}
+
+static void exit_cleanup(void)
+{
+	exiting = true;
+	for(unsigned p = 0; p < engines_started; p++)
+		kill(engine_pids[p], SIGTERM);
+	for(unsigned p = 0; p < engines_started; p++)
+		waitpid(engine_pids[p], NULL, 0);
+
+	if(listenfd == -1)
+		return;
+
+	close(listenfd);
+	if(socketpath)
+		unlink(socketpath);
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr,
+	    "Usage: %s [options] <socket path> [engine options...]\n"
+	    "  --partitions=<n>\n"
+	    "      start n engines (default 2, at most %u), listening on '<socket path>.<i>'; each\n"
+	    "      gets the symbols that hash to it and the engine options, a --query path with\n"
+	    "      '.<i>' appended\n"
+	    "  --engine=<path>\n"
+	    "      the engine binary (default: 'engine' next to this program)\n"
+	    "  --link=shm|shm-spin|socket\n"
+	    "      how commands reach the engines: a shared memory ring per client and engine whose\n"
+	    "      engine side parks on a futex when idle (default) or busy-polls, or the socket\n"
+	    "      itself. A command's round trip through the router took 3-10us more than\n"
+	    "      straight to an engine (12.5us median) with shm links and about 21us more with\n"
+	    "      sockets, most of the rest being the output's pipe from the engine; busy-polling\n"
+	    "      only pays off with a CPU to spare per client\n",
+	    argv0, max_partitions);
+}
+
+// Fibonacci hashing, so symbols that differ in one letter still spread out.
+static unsigned partition_of(const ClientCommand& command)
+{
+	return (unsigned) (((symbol_key(command) * 0x9E3779B97F4A7C15ULL) >> 32) % partitions);
+}
+
+static int connect_to(const char* path)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd == -1)
+		return -1;
+
+	struct sockaddr_un sockaddr {};
+	sockaddr.sun_family = AF_UNIX;
+	strncpy(sockaddr.sun_path, path, sizeof(sockaddr.sun_path) - 1);
+	if(connect(fd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool write_all(int fd, const void* data, size_t size, int flags = 0)
+{
+	const char* p = (const char*) data;
+	while(size > 0)
+	{
+		ssize_t written = flags != 0 ? send(fd, p, size, flags) : write(fd, p, size);
+		if(written == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		p += written;
+		size -= (size_t) written;
+	}
+	return true;
+}
+
+// A client gets a connection of its own to every engine it trades on, so
+// each engine sees it as one session: self-trade prevention, mass cancels,
+// times to live, display quantities and cancel on disconnect keep working
+// within a partition.
+// Commands are forwarded in the client's order, one write per engine for
+// everything that one read of the client brought, or pushed to its ring.
+static void serve_client(int connfd)
+{
+	ClientConnection client(connfd);
+	auto batch = std::make_unique<CommandBatch>();
+	int upstream[max_partitions];
+	std::fill(upstream, upstream + max_partitions, -1);
+	ShmRing* rings[max_partitions] {};
+	std::vector<ClientCommand> pending[max_partitions];
+	uint32_t time_to_live = 0;
+	uint32_t display = 0;
+
+	auto route = [&](unsigned p, const ClientCommand& command)
+	{
+		if(upstream[p] == -1)
+		{
+			upstream[p] = connect_to(partition_paths[p].c_str());
+			if(upstream[p] == -1)
+			{
+				perror(partition_paths[p].c_str());
+				return false;
+			}
+			if(partition_link != Link::Socket)
+			{
+				rings[p] = attach_shm_ring(upstream[p], partition_link == Link::ShmSpin ? ShmWaitMode::Spin : ShmWaitMode::Futex);
+				if(rings[p] == NULL)
+					return false;
+			}
+			// the session settings so far, for a partition that joins late
+			if(time_to_live > 0)
+			{
+				ClientCommand ttl {};
+				ttl.type = input_time_to_live;
+				ttl.count = time_to_live;
+				pending[p].push_back(ttl);
+			}
+			if(display > 0)
+			{
+				ClientCommand iceberg {};
+				iceberg.type = input_iceberg;
+				iceberg.count = display;
+				pending[p].push_back(iceberg);
+			}
+		}
+		pending[p].push_back(command);
+		return true;
+	};
+
+	bool ok = true;
+	while(ok && client.readCommands(*batch) == ReadResult::Success)
+	{
+		for(size_t i = 0; ok && i < batch->size; i++)
+		{
+			const ClientCommand& command = batch->commands[i];
+			switch(command.type)
+			{
+				case input_buy:
+				case input_sell:
+				{
+					unsigned p = partition_of(command);
+					order_partitions.put({ command.order_id, (uint8_t) p });
+					ok = route(p, command);
+					break;
+				}
+				case input_cancel:
+				{
+					// no engine knows an id the router never saw, the first one says so
+					const uint8_t* p = order_partitions.find(command.order_id);
+					ok = route(p != NULL ? *p : 0, command);
+					break;
+				}
+				case input_time_to_live:
+				case input_iceberg:
+					if(command.type == input_time_to_live)
+						time_to_live = command.count;
+					else
+						display = command.count;
+					[[fallthrough]];
+				case input_mass_cancel:
+					for(unsigned p = 0; p < partitions; p++)
+						if(upstream[p] != -1)
+							pending[p].push_back(command);
+					break;
+				default: break;
+			}
+		}
+
+		for(unsigned p = 0; p < partitions; p++)
+		{
+			if(pending[p].empty())
+				continue;
+			if(rings[p] != NULL)
+			{
+				for(const ClientCommand& command : pending[p])
+					rings[p]->push(command);
+			}
+			else
+				ok = ok && write_all(upstream[p], pending[p].data(), pending[p].size() * sizeof(ClientCommand), MSG_NOSIGNAL);
+			pending[p].clear();
+		}
+	}
+
+	for(unsigned p = 0; p < partitions; p++)
+	{
+		if(rings[p] != NULL)
+			detach_shm_ring(rings[p]);
+		if(upstream[p] != -1)
+			close(upstream[p]);
+	}
+}
+
+// Gives every line a new global number, and the lines of the '-' stream of
+// unknown orders, which every engine counts on its own, a new stream number.
+static void renumber(const char* lines, size_t size, std::string& out)
+{
+	out.clear();
+	const char* end = lines + size;
+	for(const char* line = lines; line < end;)
+	{
+		const char* eol = (const char*) memchr(line, '\n', end - line) + 1;
+		const char* stream = (const char*) memchr(line, ' ', eol - line);
+		if(stream == NULL)
+		{
+			out.append(line, eol);
+			line = eol;
+			continue;
+		}
+		stream++;
+
+		out += std::to_string(++global_sequence);
+		out += ' ';
+		const char* rest;
+		if(stream + 2 < eol && stream[0] == '-' && stream[1] == ' '
+		    && (rest = (const char*) memchr(stream + 2, ' ', eol - stream - 2)) != NULL)
+		{
+			out += "- ";
+			out += std::to_string(++unknown_sequence);
+			out.append(rest, eol);
+		}
+		else
+			out.append(stream, eol);
+		line = eol;
+	}
+}
+
+// Copies an engine's output to stdout in whole lines, so that lines of two
+// engines never mix. Every symbol's lines keep their engine's order.
+static void merge_output(unsigned partition, int fd)
+{
+	static const size_t buffer_size = 1 << 16;
+	std::unique_ptr<char[]> buffer(new char[buffer_size]);
+	size_t filled = 0;
+	std::string renumbered;
+
+	while(true)
+	{
+		ssize_t received = read(fd, buffer.get() + filled, buffer_size - filled);
+		if(received == -1 && errno == EINTR)
+			continue;
+		if(received <= 0)
+			break;
+		filled += (size_t) received;
+
+		const char* last = (const char*) memrchr(buffer.get(), '\n', filled);
+		if(last == NULL)
+			continue;
+		size_t complete = (size_t) (last - buffer.get()) + 1;
+		{
+			std::lock_guard<std::mutex> guard(output_mutex);
+			if(sequenced)
+			{
+				renumber(buffer.get(), complete, renumbered);
+				write_all(STDOUT_FILENO, renumbered.data(), renumbered.size());
+			}
+			else
+				write_all(STDOUT_FILENO, buffer.get(), complete);
+		}
+		memmove(buffer.get(), buffer.get() + complete, filled - complete);
+		filled -= complete;
+	}
+
+	close(fd);
+	if(exiting)
+		return;
+	fprintf(stderr, "Engine of partition %u exited\n", partition);
+	exit(1);
+}
+
+static bool start_engine(unsigned p, const char* engine, int argc, char* argv[])
+{
+	std::vector<std::string> args { engine };
+	for(int i = 0; i < argc; i++)
+	{
+		args.push_back(argv[i]);
+		if(strncmp(argv[i], "--query=", 8) == 0)
+			args.back().append(".").append(std::to_string(p));
+		if(strcmp(argv[i], "--sequenced") == 0)
+			sequenced = true;
+	}
+	args.push_back(partition_paths[p]);
+
+	int output[2];
+	if(pipe2(output, O_CLOEXEC) != 0)
+	{
+		perror("pipe");
+		return false;
+	}
+
+	pid_t pid = fork();
+	if(pid == -1)
+	{
+		perror("fork");
+		return false;
+	}
+	if(pid == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		dup2(output[1], STDOUT_FILENO);
+
+		std::vector<char*> exec_args;
+		for(std::string& arg : args)
+			exec_args.push_back(arg.data());
+		exec_args.push_back(NULL);
+		execvp(engine, exec_args.data());
+		perror(engine);
+		_exit(127);
+	}
+
+	close(output[1]);
+	engine_pids[engines_started++] = pid;
+	std::thread(merge_output, p, output[0]).detach();
+	return true;
+}
+
+// Until every engine accepts connections, or five seconds passed.
+static bool wait_for_engines(void)
+{
+	for(unsigned p = 0; p < partitions; p++)
+	{
+		int fd = -1;
+		for(int tries = 0; tries < 500 && (fd = connect_to(partition_paths[p].c_str())) == -1; tries++)
+		{
+			struct timespec pause { 0, 10 * 1000 * 1000 };
+			nanosleep(&pause, NULL);
+		}
+		if(fd == -1)
+		{
+			fprintf(stderr, "Engine of partition %u does not listen on %s\n", p, partition_paths[p].c_str());
+			return false;
+		}
+		close(fd);
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	std::string engine;
+
+	static const struct option long_options[] = {
+		{ "partitions", required_argument, NULL, 'p' },
+		{ "engine", required_argument, NULL, 'e' },
+		{ "link", required_argument, NULL, 'l' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	// '+': the engine options after the socket path are not ours
+	int opt;
+	while((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'p': partitions = (unsigned) strtoul(optarg, NULL, 10); break;
+			case 'e': engine = optarg; break;
+			case 'l':
+				if(strcmp(optarg, "shm") == 0)
+					partition_link = Link::Shm;
+				else if(strcmp(optarg, "shm-spin") == 0)
+					partition_link = Link::ShmSpin;
+				else if(strcmp(optarg, "socket") == 0)
+					partition_link = Link::Socket;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	if(optind >= argc || partitions == 0 || partitions > max_partitions)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	socketpath = argv[optind];
+	if(engine.empty())
+	{
+		const char* slash = strrchr(argv[0], '/');
+		engine = slash ? std::string(argv[0], slash - argv[0] + 1) + "engine" : "engine";
+	}
+	for(unsigned p = 0; p < partitions; p++)
+	{
+		partition_paths[p] = std::string(socketpath) + "." + std::to_string(p);
+		if(partition_paths[p].size() >= sizeof(((struct sockaddr_un*) NULL)->sun_path))
+		{
+			fprintf(stderr, "Socket path too long: %s\n", partition_paths[p].c_str());
+			return 1;
+		}
+	}
+
+	atexit(exit_cleanup);
+	signal(SIGINT, handle_exit_signal);
+	signal(SIGTERM, handle_exit_signal);
+
+	for(unsigned p = 0; p < partitions; p++)
+		if(!start_engine(p, engine.c_str(), argc - optind - 1, argv + optind + 1))
+			return 1;
+	if(!wait_for_engines())
+		return 1;
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(listenfd == -1)
+	{
+		perror("socket");
+		return 1;
+	}
+
+	{
+		struct sockaddr_un sockaddr {};
+		sockaddr.sun_family = AF_UNIX;
+		strncpy(sockaddr.sun_path, socketpath, sizeof(sockaddr.sun_path) - 1);
+		if(bind(listenfd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
+		{
+			perror("bind");
+			return 1;
+		}
+	}
+
+	if(listen(listenfd, 8) != 0)
+	{
+		perror("listen");
+		return 1;
+	}
+
+	while(true)
+	{
+		int connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+		if(connfd == -1)
+		{
+			perror("accept");
+			return 1;
+		}
+
+		std::thread(serve_client, connfd).detach();
+	}
+
+	return 0;
+}
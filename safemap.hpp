@@ -25,19 +25,60 @@ public:
     }
 
     Val &getOrDefault(const Key &key) {
-        typename std::unordered_map<Key, Val>::iterator ptr;
         {
             std::shared_lock lock(mtx);
-            ptr = hmap.find(key);
+            auto ptr = hmap.find(key);
+            if (ptr != hmap.end()) {
+                return ptr->second;
+            }
         }
+        std::unique_lock lock(mtx);
+        return hmap[key];
+    }
+
+    // A copy of the value for key, or nothing if there is none.
+    std::optional<Val> get(const Key &key) {
+        std::shared_lock lock(mtx);
+        auto ptr = hmap.find(key);
         if (ptr == hmap.end()) {
-            {
-                std::unique_lock lock(mtx);
-                return hmap[key];
+            return std::nullopt;
+        }
+        return ptr->second;
+    }
+
+    // The value for key, or nullptr if there is none. The value stays valid
+    // until it is erased.
+    Val *find(const Key &key) {
+        std::shared_lock lock(mtx);
+        auto ptr = hmap.find(key);
+        return ptr != hmap.end() ? &ptr->second : nullptr;
+    }
+
+    // Like getOrDefault, but a missing value is constructed from args.
+    template<typename... Args>
+    Val &getOrEmplace(const Key &key, Args &&... args) {
+        {
+            std::shared_lock lock(mtx);
+            auto ptr = hmap.find(key);
+            if (ptr != hmap.end()) {
+                return ptr->second;
             }
         }
+        std::unique_lock lock(mtx);
+        return hmap.try_emplace(key, std::forward<Args>(args)...).first->second;
+    }
 
-        return ptr->second;
+    // Constructs the value in place from args unless the key already exists.
+    template<typename... Args>
+    Val &emplace(const Key &key, Args &&... args) {
+        std::unique_lock lock(mtx);
+        return hmap.try_emplace(key, std::forward<Args>(args)...).first->second;
+    }
+
+    // Sizes the table for n entries so that it does not rehash while filling up.
+    void reserve(size_t n) {
+        std::unique_lock lock(mtx);
+        hmap.reserve(n);
     }
 
     void erase(const Key &key) {
@@ -47,6 +88,26 @@ public:
         hmap.erase(key);
     }
 
+    // Erases the entry for key only if pred(value) holds.
+    template<typename P>
+    void erase_if(const Key &key, P pred) {
+        std::unique_lock lock(mtx);
+        auto ptr = hmap.find(key);
+        if (ptr != hmap.end() && pred(ptr->second)) {
+            hmap.erase(ptr);
+        }
+    }
+
+    // Calls f(key, value) for every entry with the map shared locked, so f
+    // must not modify the map.
+    template<typename F>
+    void for_each(F f) {
+        std::shared_lock lock(mtx);
+        for (auto &[key, val]: hmap) {
+            f(key, val);
+        }
+    }
+
     uint32_t size() {
         std::shared_lock lock(mtx);
         return hmap.size();
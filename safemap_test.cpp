@@ -59,14 +59,14 @@ void int_check() {
   std::cout << "OK" << std::endl;
 }
 
-void order_writer(int id, SafeMap<std::string, std::set<std::shared_ptr<Order>, buy_cmp>> &m) {
+void order_writer(int id, SafeMap<std::string, std::set<BookEntry, buy_cmp>> &m) {
   for (int i = 0; i < NUM_ITEMS; ++i) {
     std::string key = "SYMBOL" + std::to_string(id * NUM_ITEMS + i);
     m.getOrDefault(key);
   }
 }
 
-void order_reader(SafeMap<std::string, std::set<std::shared_ptr<Order>, buy_cmp>> &m) {
+void order_reader(SafeMap<std::string, std::set<BookEntry, buy_cmp>> &m) {
   for (int i = 0; i < NUM_WRITERS * NUM_ITEMS; ++i) {
     std::string key = "SYMBOL" + std::to_string(i);
     std::cout << "Item " << (key) << " exists? " << (m.contains(key) ? "True " : "False ");
@@ -74,7 +74,7 @@ void order_reader(SafeMap<std::string, std::set<std::shared_ptr<Order>, buy_cmp>
 }
 
 void order_check() {
-  SafeMap<std::string, std::set<std::shared_ptr<Order>, buy_cmp>> m;
+  SafeMap<std::string, std::set<BookEntry, buy_cmp>> m;
   std::vector<std::thread> rt(NUM_READERS);
   std::vector<std::thread> wt(NUM_WRITERS);
 
@@ -104,6 +104,49 @@ void order_check() {
   std::cout << "OK" << std::endl;
 }
 
+// Writers put and then erase their own keys, erase_if only taking the
+// entries that still hold their own value; readers copy values out with get.
+void erase_writer(int id, SafeMap<int, int> &m) {
+  for (int i = 0; i < NUM_ITEMS; ++i) {
+    int key = id * NUM_ITEMS + i;
+    m.put({key, id});
+    m.erase_if(key, [&](int value) { return value != id; });
+    assert(m.get(key) == id);
+    m.erase_if(key, [&](int value) { return value == id; });
+  }
+}
+
+void erase_reader(SafeMap<int, int> &m) {
+  for (int i = 0; i < NUM_WRITERS * NUM_ITEMS; ++i) {
+    std::optional<int> value = m.get(i);
+    assert(!value || *value == i / NUM_ITEMS);
+  }
+}
+
+void erase_check() {
+  SafeMap<int, int> m;
+  std::vector<std::thread> rt(NUM_READERS);
+  std::vector<std::thread> wt(NUM_WRITERS);
+
+  for (int i = 0; i < NUM_WRITERS; ++i) {
+    wt[i] = std::thread(erase_writer, i, std::ref(m));
+  }
+  for (int i = 0; i < NUM_READERS; ++i) {
+    rt[i] = std::thread(erase_reader, std::ref(m));
+  }
+
+  for (auto& t: wt)
+    t.join();
+
+  for (auto& t: rt)
+    t.join();
+
+  std::cout << " == Erase check: == " << m.size() << " entries left" << std::endl;
+  assert(m.size() == 0);
+  assert(!m.get(0));
+  std::cout << "OK" << std::endl;
+}
+
 void setup() {
   for (int i = 0; i < NUM_WRITERS * NUM_ITEMS; i++)
     global_symbols.push_back("SYMBOL" + std::to_string(i));
@@ -113,5 +156,6 @@ int main() {
   setup();
   int_check();
   order_check();
+  erase_check();
   return 0;
 }
@@ -3,18 +3,40 @@
 
 #include <set>
 #include <iterator>
+#include <memory_resource>
 #include <mutex>
 #include <shared_mutex>
 #include "order.hpp"
 
+/*
+ * Nodes come from a per-set pool: an erased node goes on a free list and
+ * the next insert takes it back, so the memory held follows the deepest the
+ * book has been, not the number of orders it has ever seen. The pool draws
+ * its chunks from an arena; passing the expected number of elements sizes
+ * the first arena block so that filling the set up to that depth does not
+ * hit the global allocator. The pool is only touched by insert and erase,
+ * which hold mtx exclusively.
+ */
 template<typename Key, typename Compare = std::less<Key>>
 class SafeSet {
 private:
+    typedef std::set<Key, Compare, std::pmr::polymorphic_allocator<Key>> set_t;
+    typedef typename set_t::iterator it_t;
+
     std::shared_mutex mtx;
-    std::set<Key, Compare> s;
-    typedef typename std::set<Key, Compare>::iterator it_t;
+    std::pmr::monotonic_buffer_resource arena;
+    std::pmr::unsynchronized_pool_resource pool;
+    set_t s;
 
 public:
+    // rb-tree node: colour + parent/left/right links + the key
+    static constexpr size_t node_size_estimate = sizeof(Key) + 4 * sizeof(void *);
+
+    explicit SafeSet(size_t expected_size = 0)
+            : arena{expected_size > 0 ? expected_size * node_size_estimate : node_size_estimate * 16},
+              pool{std::pmr::pool_options{expected_size, 0}, &arena},
+              s{&pool} {}
+
     void insert(const Key &item) {
         std::unique_lock lock(mtx);
         s.insert(item);
@@ -30,17 +52,26 @@ public:
         s.erase(it);
     }
 
-    typename std::set<Key, Compare>::iterator begin() {
+    // Erases elements from the front for as long as pred holds.
+    template<typename Pred>
+    void erase_while_front(Pred pred) {
+        std::unique_lock lock(mtx);
+        while (!s.empty() && pred(*s.begin())) {
+            s.erase(s.begin());
+        }
+    }
+
+    it_t begin() {
         std::shared_lock lock(mtx);
         return s.cbegin();
     }
 
-    typename std::set<Key, Compare>::iterator end() {
+    it_t end() {
         std::shared_lock lock(mtx);
         return s.cend();
     }
 
-    typename std::set<Key, Compare>::iterator next(const it_t &it) {
+    it_t next(const it_t &it) {
         std::shared_lock lock(mtx);
         return std::next(it, 1);
     }
@@ -61,22 +61,22 @@ void int_check() {
 
 }
 
-void order_writer(int id, SafeSet<std::shared_ptr<Order>, buy_cmp> &s) {
+void order_writer(int id, SafeSet<BookEntry, buy_cmp> &s) {
     for (int i = 0; i < NUM_ITEMS; ++i) {
         int x = id * NUM_ITEMS + i;
-        s.insert(std::make_shared<Order>(x, x, x, x));
+        s.insert({static_cast<uint32_t>(x), static_cast<uint64_t>(x), std::make_shared<Order>(x, x, x, x)});
     }
 }
 
-void order_reader(SafeSet<std::shared_ptr<Order>, buy_cmp> &s) {
+void order_reader(SafeSet<BookEntry, buy_cmp> &s) {
     auto it = s.begin();
     for (; it != s.end(); it = s.next(it)) {
-        std::cout << *it << std::endl;
+        std::cout << *it->order << std::endl;
     }
 }
 
 void order_check() {
-    SafeSet<std::shared_ptr<Order>, buy_cmp> s;
+    SafeSet<BookEntry, buy_cmp> s;
     std::vector<std::thread> rt(NUM_READERS);
     std::vector<std::thread> wt(NUM_WRITERS);
 
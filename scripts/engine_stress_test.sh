@@ -0,0 +1,40 @@
+#!/bin/bash
+# Runs engine_stress_test under TSAN and ASAN, then plain across thread
+# counts as a scalability benchmark. Extra arguments go to every run.
+
+CXX=${CXX:-clang++}
+FLAGS="-g -O2 -Wall -Wextra -pedantic -Werror -std=c++20 -pthread -fPIE -pie"
+SRCS="engine_stress_test.cpp engine.cpp executor.cpp io.cpp order.cpp"
+
+echo "running TSAN"
+$CXX $FLAGS -fsanitize=thread $SRCS -o a.tsan || exit 1
+./a.tsan --threads=8 --ops=5000 "$@" > /dev/null
+[[ $? == 0 ]] && echo "TSAN OK"
+echo ""
+
+echo "running TSAN, skip list books"
+$CXX $FLAGS -DSKIPLIST_BOOK -fsanitize=thread $SRCS -o a.tsan || exit 1
+./a.tsan --threads=8 --ops=5000 "$@" > /dev/null
+[[ $? == 0 ]] && echo "TSAN OK"
+echo ""
+
+echo "running ASAN"
+$CXX $FLAGS -fsanitize=address $SRCS -o a.asan || exit 1
+./a.asan --threads=8 --ops=20000 "$@" > /dev/null
+[[ $? == 0 ]] && echo "ASAN OK"
+echo ""
+
+echo "running ASAN, skip list books"
+$CXX $FLAGS -DSKIPLIST_BOOK -fsanitize=address $SRCS -o a.asan || exit 1
+./a.asan --threads=8 --ops=20000 "$@" > /dev/null
+[[ $? == 0 ]] && echo "ASAN OK"
+echo ""
+
+rm a.tsan
+rm a.asan
+
+echo "scalability"
+make engine_stress_test > /dev/null || exit 1
+for threads in 1 2 4 8 16; do
+  ./engine_stress_test --threads=$threads "$@" | head -1
+done
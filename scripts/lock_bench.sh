@@ -0,0 +1,16 @@
+#!/bin/bash
+# Compares the engine's lock sites on AdaptiveMutex with the old std::mutex
+# ones on a contended workload. Extra arguments go to lock_bench.
+
+echo "== AdaptiveMutex lock sites, with contention counters"
+make clean > /dev/null
+make CPPFLAGS=-DLOCK_STATS lock_bench > /dev/null || exit 1
+./lock_bench "$@"
+echo ""
+
+echo "== std::mutex lock sites"
+make clean > /dev/null
+make CPPFLAGS=-DSTD_LOCKS lock_bench > /dev/null || exit 1
+./lock_bench "$@"
+
+make clean > /dev/null
@@ -0,0 +1,70 @@
+#!/bin/bash
+# Runs the single connection tests through the router with three engine
+# partitions, over each kind of partition link, and through one engine, and
+# compares every symbol's stream (lines and symbol sequence numbers,
+# timestamps left out). Then runs the multi connection scripts through the
+# router over shm and socket links, and validate checks the merged,
+# renumbered output.
+
+make engine client router validate > /dev/null || exit 1
+
+dir=$(mktemp -d)
+trap 'kill $(jobs -p) 2> /dev/null; rm -rf $dir' EXIT
+
+# run <server> <input> <output> [server options...]: one client per thread of the input
+run() {
+  local server=$1 input=$2 output=$3
+  shift 3
+  rm -f $dir/sock*
+  $server "$@" $dir/sock --sequenced > $output &
+  local pid=$!
+  for i in $(seq 50); do [[ -S $dir/sock ]] && break; sleep 0.1; done
+
+  local threads=$(head -1 $input)
+  local clients=()
+  for t in $(seq 0 $((threads - 1))); do
+    if [[ $threads == 1 ]]; then
+      grep -E '^[BSCMT] ' $input
+    else
+      awk -v t=$t '$1 == t { $1 = ""; print substr($0, 2) }' $input
+    fi | ./client $dir/sock 2> /dev/null &
+    clients+=($!)
+  done
+  wait ${clients[@]}
+  sleep 0.3
+  kill $pid
+  wait $pid 2> /dev/null
+}
+
+# '<symbol> <symbol seq> <line without timestamp>', by symbol
+streams() {
+  awk '{ $1 = ""; $NF = ""; print substr($0, 2) }' $1 | sort -s -k1,1
+}
+
+failed=0
+for input in tests/*.in scripts/test.in; do
+  run ./engine $input $dir/engine.out
+  for link in shm shm-spin socket; do
+    run ./router $input $dir/router.out --partitions=3 --link=$link
+    if ! diff <(streams $dir/engine.out) <(streams $dir/router.out) > /dev/null; then
+      echo "$input: router output differs with --link=$link"
+      failed=1
+    fi
+  done
+done
+[[ $failed == 0 ]] && echo "single connection OK"
+
+for input in scripts/four-threads.in scripts/multicancel.in scripts/multisell_multibuy.in scripts/single-symbol.in; do
+  run ./router $input $dir/router.out --partitions=3 --link=socket
+  if ! ./validate $dir/router.out 2> $dir/validate.txt; then
+    echo "$input: $(tail -1 $dir/validate.txt) with --link=socket"
+    failed=1
+  fi
+  run ./router $input $dir/router.out --partitions=3
+  if ! ./validate $dir/router.out 2> $dir/validate.txt; then
+    echo "$input: $(tail -1 $dir/validate.txt)"
+    failed=1
+  fi
+done
+[[ $failed == 0 ]] && echo "multi connection OK"
+exit $failed
@@ -0,0 +1,21 @@
+#!/bin/bash
+# Replays every test script under each self-trade prevention mode and a few
+# seeds, and has validate check the output. scripts/self-trade.in has both
+# clients cross their own orders, icebergs included.
+
+make replay validate > /dev/null || exit 1
+
+failed=0
+for stp in none cancel-resting cancel-incoming decrement-both; do
+  for input in tests/*.in scripts/*.in; do
+    for seed in 1 2 3; do
+      result=$(./replay --stp=$stp --seed=$seed --sequenced $input 2> /dev/null | ./validate 2>&1 | tail -1)
+      if [[ $result != *" 0 violations" ]]; then
+        echo "$input --stp=$stp --seed=$seed: $result"
+        failed=1
+      fi
+    done
+  done
+done
+[[ $failed == 0 ]] && echo "OK"
+exit $failed
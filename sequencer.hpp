@@ -0,0 +1,174 @@
+#ifndef SEQUENCER_HPP
+#define SEQUENCER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "bookview.hpp"
+#include "io.hpp"
+
+class Order;
+
+/*
+ * Puts the output of one instrument back into the order its state changes
+ * happened in, so that nothing has to be written while a book or an order
+ * is locked.
+ *
+ * A change takes the next sequence number while the locks that ordered it
+ * are still held, releases the order locks and stages its events under
+ * that number, which only copies them into a reorder window. Two changes
+ * to the same order are always ordered by that order's mutex, so their
+ * numbers are too. Once the thread holds no lock at all it drains: whoever
+ * finds the window's front ready writes out every consecutive ready entry
+ * in one block, the others return right away. That only merges changes
+ * that are staged while the front is not ready yet or being written; a
+ * thread that drains after each of its own stages writes each on its own,
+ * so output meant to go out as one block has to be staged in one batch,
+ * or in several before a single drain. Staging never waits, the
+ * window grows instead; draining waits while the thread's own number is
+ * more than `window` ahead of the output, which holds back a thread that
+ * outruns the writer without ever holding a lock while it waits.
+ *
+ * When sequenced, every written event is numbered within the stream from
+ * 1 upwards, in that same order, so a consumer can tell a lost event from
+ * a reordered one. A BookView, if given, is handed every block before it is
+ * written. The orders a change closed can be staged along with its events;
+ * they are handed to on_closed once the block is written, so whatever
+ * forgets them cannot get ahead of their last output.
+ */
+class Sequencer {
+public:
+    static constexpr uint64_t window = 256;
+
+    typedef std::function<void(const std::shared_ptr<Order> &)> ClosedHandler;
+
+    explicit Sequencer(std::string stream = {}, bool sequenced = false, BookView *view = nullptr,
+                       ClosedHandler on_closed = {})
+            : stream{std::move(stream)}, sequenced{sequenced}, view{view}, on_closed{std::move(on_closed)},
+              slots(window) {}
+
+    Sequencer(const Sequencer &) = delete;
+
+    Sequencer &operator=(const Sequencer &) = delete;
+
+    // Must be called with the locks that ordered the change held.
+    uint64_t next() {
+        return next_seq.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // May be called with the book locks still held; every number taken
+    // must be staged exactly once. Takes the closed orders, if any, and
+    // leaves the vector empty.
+    void stage(uint64_t seq, const OutputEvent *events, size_t n,
+               std::vector<std::shared_ptr<Order>> *closed = nullptr) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (seq - drained >= slots.size()) {
+            grow(seq - drained + 1);
+        }
+        Slot &slot = slots[seq % slots.size()];
+        slot.events.assign(events, events + n);
+        if (closed != nullptr) {
+            slot.closed.swap(*closed);
+        }
+        slot.ready = true;
+    }
+
+    // Writes out what is ready after staging `seq`. Must be called with no
+    // lock held, by every thread after its last stage.
+    void drain(uint64_t seq) {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            if (!draining && slots[drained % slots.size()].ready) {
+                write_ready(lock);
+            }
+            // the front is being written, or is still to be staged by a
+            // thread that drains right after
+            if (seq < drained + window) {
+                return;
+            }
+            slot_free.wait(lock);
+        }
+    }
+
+    // Both at once, for a change made with no lock held.
+    void deposit(uint64_t seq, const OutputEvent *events, size_t n) {
+        stage(seq, events, n);
+        drain(seq);
+    }
+
+private:
+    struct Slot {
+        bool ready = false;
+        std::vector<OutputEvent> events; // keeps its capacity between uses
+        std::vector<std::shared_ptr<Order>> closed;
+    };
+
+    // Called with mtx held and the front ready; leaves it held.
+    void write_ready(std::unique_lock<std::mutex> &lock) {
+        draining = true;
+        while (slots[drained % slots.size()].ready) {
+            out.clear();
+            for (Slot *s = &slots[drained % slots.size()]; s->ready; s = &slots[drained % slots.size()]) {
+                out.insert(out.end(), s->events.begin(), s->events.end());
+                for (auto &order: s->closed) {
+                    out_closed.push_back(std::move(order));
+                }
+                s->closed.clear();
+                s->ready = false;
+                ++drained;
+            }
+            lock.unlock();
+
+            if (view != nullptr) {
+                view->apply(out.data(), out.size());
+            }
+            const uint64_t first = written + 1;
+            written += out.size();
+            Output::Publish(out.data(), out.size(), sequenced ? stream.c_str() : nullptr, first);
+            for (const auto &order: out_closed) {
+                on_closed(order);
+            }
+            out_closed.clear();
+            lock.lock();
+            slot_free.notify_all();
+        }
+        draining = false;
+    }
+
+    // Makes room for `needed` numbers from `drained` on; entries keep
+    // their number, so they move to the slot it maps to now.
+    void grow(uint64_t needed) {
+        size_t size = slots.size();
+        while (size < needed) {
+            size *= 2;
+        }
+        std::vector<Slot> grown(size);
+        for (uint64_t seq = drained; seq < drained + slots.size(); ++seq) {
+            std::swap(grown[seq % size], slots[seq % slots.size()]);
+        }
+        slots.swap(grown);
+    }
+
+    const std::string stream;
+    const bool sequenced;
+    BookView *const view;
+    const ClosedHandler on_closed;
+    std::atomic<uint64_t> next_seq{0};
+
+    std::mutex mtx;
+    std::condition_variable slot_free;
+    std::vector<Slot> slots; // a power of two, at least `window`
+    uint64_t drained = 0;    // every number below this has been written
+    bool draining = false;   // a thread is writing, it rechecks before it stops
+    // only used by the draining thread
+    uint64_t written = 0;    // events handed to Output so far
+    std::vector<OutputEvent> out;
+    std::vector<std::shared_ptr<Order>> out_closed;
+};
+
+#endif // SEQUENCER_HPP
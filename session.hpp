@@ -0,0 +1,89 @@
+#ifndef SESSION_HPP
+#define SESSION_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "order.hpp"
+
+/*
+ * Per-connection state. Keeps an intrusive doubly linked list of the
+ * session's resting orders (through Order::session_prev/session_next) so
+ * that all of them can be cancelled in O(open orders).
+ *
+ * Lock order: Order::order_mutex, then open_orders_mutex.
+ */
+struct Session {
+    const uint32_t id;
+
+    // length of the open-order list, readable without its lock
+    std::atomic<uint32_t> resting_orders{0};
+
+    // expiry of the session's next orders in milliseconds, 0 for none; only
+    // used by the thread handling the session's commands
+    uint32_t order_ttl_ms = 0;
+
+    // displayed quantity of the session's next orders, 0 to display all;
+    // same as order_ttl_ms
+    uint32_t order_display = 0;
+
+    // turns that waited for the session's rate limit, and turns that used up
+    // the quantum and left the rest of its input for the next turn
+    std::atomic<uint64_t> throttled{0};
+    std::atomic<uint64_t> deferred{0};
+
+    explicit Session(uint32_t id) : id{id} {}
+
+    Session(const Session &) = delete;
+
+    Session &operator=(const Session &) = delete;
+
+    void link(Order &order) {
+        std::lock_guard<std::mutex> guard(open_orders_mutex);
+        order.session_prev = nullptr;
+        order.session_next = open_orders;
+        if (open_orders != nullptr) {
+            open_orders->session_prev = &order;
+        }
+        open_orders = &order;
+        resting_orders.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // No-op if the order was already unlinked.
+    void unlink(Order &order) {
+        std::lock_guard<std::mutex> guard(open_orders_mutex);
+        if (order.session_prev != nullptr) {
+            order.session_prev->session_next = order.session_next;
+        } else if (open_orders == &order) {
+            open_orders = order.session_next;
+        } else {
+            return;
+        }
+        if (order.session_next != nullptr) {
+            order.session_next->session_prev = order.session_prev;
+        }
+        order.session_prev = nullptr;
+        order.session_next = nullptr;
+        resting_orders.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // The orders linked right now, newest first. A linked order is not
+    // released yet, so its book still owns it while it is picked up here.
+    std::vector<std::shared_ptr<Order>> open_orders_snapshot() {
+        std::vector<std::shared_ptr<Order>> orders;
+        std::lock_guard<std::mutex> guard(open_orders_mutex);
+        orders.reserve(resting_orders.load(std::memory_order_relaxed));
+        for (Order *order = open_orders; order != nullptr; order = order->session_next) {
+            orders.push_back(order->shared_from_this());
+        }
+        return orders;
+    }
+
+private:
+    std::mutex open_orders_mutex;
+    Order *open_orders = nullptr;
+};
+
+#endif // SESSION_HPP
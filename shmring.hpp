@@ -0,0 +1,214 @@
+#ifndef SHMRING_HPP
+#define SHMRING_HPP
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io.hpp"
+#include "spin.hpp"
+
+enum class ShmWaitMode : uint32_t {
+    Spin = 0,  // consumer busy-polls the ring
+    Futex = 1  // consumer parks on a futex once the ring runs dry
+};
+
+/*
+ * Single-producer single-consumer ring of ClientCommand that lives in a
+ * memfd segment shared between one client and the engine. The client is
+ * the only producer, the engine connection the only consumer.
+ *
+ * head/tail are free-running counters; the slot index is counter % capacity.
+ * Both counters double as futex words so either side can park on them.
+ */
+struct ShmRing {
+    static constexpr uint32_t magic_value = 0x52494e47; // "RING"
+    static constexpr uint32_t capacity = 4096;
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+    uint32_t magic;
+    ShmWaitMode wait_mode;
+
+    alignas(64) std::atomic<uint32_t> head; // written by producer
+    std::atomic<uint32_t> producer_waiting;
+
+    alignas(64) std::atomic<uint32_t> tail; // written by consumer
+    std::atomic<uint32_t> consumer_waiting;
+
+    alignas(64) std::atomic<uint32_t> closed; // producer will not push anymore
+
+    alignas(64) ClientCommand slots[capacity];
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "futex words must be lock free");
+
+    void init(ShmWaitMode mode) {
+        magic = magic_value;
+        wait_mode = mode;
+        head.store(0, std::memory_order_relaxed);
+        producer_waiting.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        consumer_waiting.store(0, std::memory_order_relaxed);
+        closed.store(0, std::memory_order_release);
+    }
+
+    bool try_push(const ClientCommand &cmd) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == capacity) {
+            return false;
+        }
+        slots[h & (capacity - 1)] = cmd;
+        head.store(h + 1, std::memory_order_seq_cst);
+        if (consumer_waiting.load(std::memory_order_seq_cst)) {
+            wake(head);
+        }
+        return true;
+    }
+
+    bool try_pop(ClientCommand &cmd) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        cmd = slots[t & (capacity - 1)];
+        tail.store(t + 1, std::memory_order_seq_cst);
+        if (producer_waiting.load(std::memory_order_seq_cst)) {
+            wake(tail);
+        }
+        return true;
+    }
+
+    bool empty() const {
+        return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+
+    // Blocks the producer until there is room (or the consumer went away,
+    // which the caller detects through the socket).
+    void push(const ClientCommand &cmd) {
+        for (uint32_t spins = 0; !try_push(cmd); ++spins) {
+            if (wait_mode == ShmWaitMode::Spin || spins < spin_limit) {
+                cpu_relax();
+                continue;
+            }
+            uint32_t t = tail.load(std::memory_order_relaxed);
+            producer_waiting.store(1, std::memory_order_seq_cst);
+            if (head.load(std::memory_order_relaxed) - t == capacity) {
+                wait(tail, t, park_timeout_ns);
+            }
+            producer_waiting.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Waits until the ring is non-empty or the timeout elapses. Returns
+    // false on timeout so the consumer can check whether the peer is alive.
+    bool wait_readable(long timeout_ns) {
+        for (uint32_t spins = 0; spins < spin_limit; ++spins) {
+            if (!empty()) {
+                return true;
+            }
+            cpu_relax();
+        }
+        if (wait_mode == ShmWaitMode::Spin) {
+            return !empty();
+        }
+        uint32_t h = head.load(std::memory_order_relaxed);
+        consumer_waiting.store(1, std::memory_order_seq_cst);
+        if (tail.load(std::memory_order_relaxed) == h) {
+            wait(head, h, timeout_ns);
+        }
+        consumer_waiting.store(0, std::memory_order_relaxed);
+        return !empty();
+    }
+
+    void close() {
+        closed.store(1, std::memory_order_seq_cst);
+        wake(head);
+    }
+
+private:
+    static constexpr uint32_t spin_limit = 1024;
+    static constexpr long park_timeout_ns = 100'000'000;
+
+    // Shared (not FUTEX_PRIVATE) operations: the words live in memory mapped
+    // by two different processes.
+    static void wait(std::atomic<uint32_t> &word, uint32_t expected, long timeout_ns) {
+        struct timespec ts {timeout_ns / 1'000'000'000, timeout_ns % 1'000'000'000};
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+    }
+
+    static void wake(std::atomic<uint32_t> &word) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+};
+
+/*
+ * Producer side of the handshake: creates a memfd backed ring and hands it
+ * to the engine over the connected socket fd, which stays open to tell
+ * either side when the other went away. Returns nullptr, after printing
+ * why, if that fails.
+ */
+inline ShmRing *attach_shm_ring(int fd, ShmWaitMode mode) {
+    int memfd = memfd_create("client-ring", MFD_CLOEXEC);
+    if (memfd == -1) {
+        perror("memfd_create");
+        return nullptr;
+    }
+    if (ftruncate(memfd, sizeof(ShmRing)) != 0) {
+        perror("ftruncate");
+        close(memfd);
+        return nullptr;
+    }
+
+    void *mem = mmap(nullptr, sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        close(memfd);
+        return nullptr;
+    }
+
+    ShmRing *ring = new(mem) ShmRing;
+    ring->init(mode);
+
+    ClientCommand handshake{};
+    handshake.type = input_shm_attach;
+
+    char control[CMSG_SPACE(sizeof(int))]{};
+    struct iovec iov{&handshake, sizeof(handshake)};
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    if (sent != sizeof(handshake)) {
+        perror("sendmsg");
+        munmap(mem, sizeof(ShmRing));
+        return nullptr;
+    }
+    return ring;
+}
+
+// Tells the consumer no more commands come and unmaps the producer's side.
+inline void detach_shm_ring(ShmRing *ring) {
+    ring->close();
+    munmap(ring, sizeof(ShmRing));
+}
+
+#endif // SHMRING_HPP
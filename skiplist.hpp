@@ -0,0 +1,430 @@
+#ifndef SKIPLIST_HPP
+#define SKIPLIST_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <unordered_set>
+
+#include "epoch.hpp"
+
+/*
+ * Ordered concurrent skip list with the same interface as SafeSet.
+ *
+ * Lock-free in the style of Herlihy & Shavit: a node is published on the
+ * bottom level with a single CAS and then linked into the upper levels one
+ * CAS at a time. Erase marks the low bit of the node's next links (top
+ * level first, the bottom level decides who erased it), and any later
+ * find() that walks past a marked node snips it out.
+ *
+ * Traversal never blocks, so a matching loop walking the book is not held
+ * up by inserts or erases on the same side. Memory is reclaimed by epochs
+ * (epoch.hpp): every operation, and every iterator for as long as it
+ * lives, keeps its thread pinned, and a node is retired once it is off
+ * every level and freed when no thread pinned before that is left. So an
+ * iterator always points at live memory and there is no ABA, but it must
+ * stay on the thread that made it.
+ *
+ * A node is allocated with room for its own levels only.
+ */
+template<typename Key, typename Compare = std::less<Key>>
+class SkipList {
+private:
+    static constexpr int max_level = 16;
+
+    static constexpr uint32_t reclaim_batch = 64;
+
+    typedef std::atomic<uintptr_t> link_t; // Node * with the low bit as the erase mark
+
+    // followed in the same allocation by its level links
+    struct Node {
+        Key key;
+        int level;
+        std::atomic<int> refs; // one per level it is linked on, one while its insert runs
+        uint64_t retired_epoch = 0;
+        Node *retired_next = nullptr;
+
+        Node(const Key &k, int lvl) : key{k}, level{lvl}, refs{0} {
+            for (int i = 0; i < level; ++i) {
+                new(&next()[i]) link_t{0};
+            }
+        }
+
+        link_t *next() { return reinterpret_cast<link_t *>(this + 1); }
+    };
+
+    static constexpr size_t node_bytes(int level) {
+        return (sizeof(Node) + level * sizeof(link_t) + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+    }
+
+    Node *head; // sentinel on every level, its key is never compared
+    std::atomic<uint32_t> count{0};
+    Compare cmp;
+
+    std::atomic<Node *> retired{nullptr};
+    std::atomic<uint32_t> retired_count{0};
+    std::atomic<uint32_t> reclaim_at{reclaim_batch};
+    std::atomic<bool> reclaiming{false};
+    uint64_t reclaimed_below = 0; // the safe epoch of the last pass, under reclaiming
+
+    // optional pre-sized node arena, handed out with a bump pointer; its
+    // space is not reused once the nodes in it are freed
+    char *arena = nullptr;
+    size_t arena_capacity = 0;
+    std::atomic<size_t> arena_next{0};
+
+    static Node *ptr(uintptr_t link) { return reinterpret_cast<Node *>(link & ~uintptr_t{1}); }
+
+    static bool marked(uintptr_t link) { return link & 1; }
+
+    static uintptr_t link_to(Node *n) { return reinterpret_cast<uintptr_t>(n); }
+
+    Node *new_node(const Key &key, int lvl) {
+        const size_t bytes = node_bytes(lvl);
+        if (arena_next.load(std::memory_order_relaxed) < arena_capacity) {
+            size_t offset = arena_next.fetch_add(bytes, std::memory_order_relaxed);
+            if (offset + bytes <= arena_capacity) {
+                return new(arena + offset) Node(key, lvl);
+            }
+        }
+        return new(::operator new(bytes)) Node(key, lvl);
+    }
+
+    void delete_node(Node *n) {
+        n->~Node();
+        char *p = reinterpret_cast<char *>(n);
+        if (p < arena || p >= arena + arena_capacity) {
+            ::operator delete(n);
+        }
+    }
+
+    // Drops one reference; the last one retires the node.
+    void unref(Node *n) {
+        if (n->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            retire(n);
+        }
+    }
+
+    // n is off every level; whoever still sees it is pinned in an earlier epoch.
+    void retire(Node *n) {
+        n->retired_epoch = EpochDomain::instance().retire_epoch();
+        Node *top = retired.load(std::memory_order_relaxed);
+        do {
+            n->retired_next = top;
+        } while (!retired.compare_exchange_weak(top, n, std::memory_order_release, std::memory_order_relaxed));
+        if (retired_count.fetch_add(1, std::memory_order_relaxed) + 1 >= reclaim_at.load(std::memory_order_relaxed)) {
+            reclaim();
+        }
+    }
+
+    // Frees the retired nodes no pinned thread can reach, every batch of
+    // retires. While the oldest pin stays where it was, nothing new can be
+    // freed and the list is not walked.
+    void reclaim() {
+        if (reclaiming.exchange(true, std::memory_order_acquire)) {
+            return;
+        }
+        if (EpochDomain::instance().safe_epoch() == reclaimed_below) {
+            reclaim_at.store(retired_count.load(std::memory_order_relaxed) + reclaim_batch,
+                             std::memory_order_relaxed);
+            reclaiming.store(false, std::memory_order_release);
+            return;
+        }
+        Node *n = retired.exchange(nullptr, std::memory_order_acquire);
+        const uint64_t safe = EpochDomain::instance().safe_epoch();
+        Node *keep = nullptr;
+        Node *keep_tail = nullptr;
+        uint32_t freed = 0;
+        uint32_t kept = 0;
+        while (n != nullptr) {
+            Node *next = n->retired_next;
+            if (n->retired_epoch < safe) {
+                delete_node(n);
+                ++freed;
+            } else {
+                n->retired_next = keep;
+                keep = n;
+                if (keep_tail == nullptr) {
+                    keep_tail = n;
+                }
+                ++kept;
+            }
+            n = next;
+        }
+        if (keep != nullptr) {
+            Node *top = retired.load(std::memory_order_relaxed);
+            do {
+                keep_tail->retired_next = top;
+            } while (!retired.compare_exchange_weak(top, keep, std::memory_order_release,
+                                                    std::memory_order_relaxed));
+        }
+        retired_count.fetch_sub(freed, std::memory_order_relaxed);
+        reclaim_at.store(kept + reclaim_batch, std::memory_order_relaxed);
+        reclaimed_below = safe;
+        reclaiming.store(false, std::memory_order_release);
+    }
+
+    static int random_level() {
+        // p = 1/4, xorshift seeded per thread
+        thread_local uint64_t state = 0x9e3779b97f4a7c15ULL ^ reinterpret_cast<uintptr_t>(&state);
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int lvl = 1;
+        for (uint64_t bits = state; lvl < max_level && (bits & 3) == 0; bits >>= 2) {
+            ++lvl;
+        }
+        return lvl;
+    }
+
+    // Fills preds/succs so that preds[i] < key <= succs[i] on every level,
+    // unlinking erased nodes on the way. Returns the live node holding an
+    // equivalent key, if any.
+    Node *find(const Key &key, Node **preds, Node **succs) {
+    retry:
+        Node *pred = head;
+        for (int i = max_level - 1; i >= 0; --i) {
+            Node *curr = ptr(pred->next()[i].load(std::memory_order_acquire));
+            while (curr != nullptr) {
+                uintptr_t succ = curr->next()[i].load(std::memory_order_acquire);
+                if (marked(succ)) {
+                    uintptr_t expected = link_to(curr);
+                    if (!pred->next()[i].compare_exchange_strong(expected, succ & ~uintptr_t{1},
+                                                                 std::memory_order_acq_rel,
+                                                                 std::memory_order_relaxed)) {
+                        goto retry; // pred changed or is being erased itself
+                    }
+                    unref(curr);
+                    curr = ptr(succ);
+                    continue;
+                }
+                if (!cmp(curr->key, key)) {
+                    break;
+                }
+                pred = curr;
+                curr = ptr(succ);
+            }
+            preds[i] = pred;
+            succs[i] = curr;
+        }
+        Node *candidate = succs[0];
+        if (candidate != nullptr && !cmp(key, candidate->key)) {
+            return candidate;
+        }
+        return nullptr;
+    }
+
+    // The node is visible on the bottom level; the upper ones are only shortcuts.
+    void link_upper_levels(Node *node, Node **preds, Node **succs) {
+        for (int i = 1; i < node->level; ++i) {
+            while (true) {
+                uintptr_t link = node->next()[i].load(std::memory_order_acquire);
+                if (marked(link)) {
+                    return; // erased while we were still linking it
+                }
+                if (ptr(link) != succs[i] &&
+                    !node->next()[i].compare_exchange_strong(link, link_to(succs[i]),
+                                                             std::memory_order_release,
+                                                             std::memory_order_relaxed)) {
+                    continue;
+                }
+                node->refs.fetch_add(1, std::memory_order_relaxed);
+                uintptr_t expected = link_to(succs[i]);
+                if (preds[i]->next()[i].compare_exchange_strong(expected, link_to(node),
+                                                                std::memory_order_release,
+                                                                std::memory_order_relaxed)) {
+                    break;
+                }
+                node->refs.fetch_sub(1, std::memory_order_relaxed);
+                if (find(node->key, preds, succs) != node) {
+                    return; // erased and already unlinked
+                }
+            }
+        }
+    }
+
+    static Node *skip_erased(Node *n) {
+        while (n != nullptr) {
+            uintptr_t succ = n->next()[0].load(std::memory_order_acquire);
+            if (!marked(succ)) {
+                break;
+            }
+            n = ptr(succ);
+        }
+        return n;
+    }
+
+public:
+    class iterator {
+    private:
+        EpochPin pin;
+        Node *node;
+        friend class SkipList;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Key;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Key *;
+        using reference = const Key &;
+
+        explicit iterator(Node *n = nullptr) : node{n} {}
+
+        reference operator*() const { return node->key; }
+
+        pointer operator->() const { return &node->key; }
+
+        iterator &operator++() {
+            node = skip_erased(ptr(node->next()[0].load(std::memory_order_acquire)));
+            return *this;
+        }
+
+        bool operator==(const iterator &other) const { return node == other.node; }
+
+        bool operator!=(const iterator &other) const { return node != other.node; }
+    };
+
+    // a node has 4/3 levels on average
+    static constexpr size_t node_size_estimate = sizeof(Node) + sizeof(link_t) * 4 / 3;
+
+    // expected_size pre-allocates room for that many nodes up front
+    explicit SkipList(size_t expected_size = 0)
+            : head{new(::operator new(node_bytes(max_level))) Node(Key{}, max_level)} {
+        if (expected_size > 0) {
+            arena_capacity = expected_size * node_size_estimate;
+            arena = static_cast<char *>(::operator new(arena_capacity, std::align_val_t{alignof(Node)}));
+        }
+    }
+
+    SkipList(const SkipList &) = delete;
+
+    SkipList &operator=(const SkipList &) = delete;
+
+    ~SkipList() {
+        // an erased node may still be linked on an upper level only
+        std::unordered_set<Node *> nodes;
+        for (int i = 0; i < max_level; ++i) {
+            for (Node *n = ptr(head->next()[i].load(std::memory_order_relaxed)); n != nullptr;
+                 n = ptr(n->next()[i].load(std::memory_order_relaxed))) {
+                nodes.insert(n);
+            }
+        }
+        for (Node *n = retired.load(std::memory_order_relaxed); n != nullptr; n = n->retired_next) {
+            nodes.insert(n);
+        }
+        for (Node *n: nodes) {
+            delete_node(n);
+        }
+        head->~Node();
+        ::operator delete(head);
+        if (arena != nullptr) {
+            ::operator delete(arena, std::align_val_t{alignof(Node)});
+        }
+    }
+
+    void insert(const Key &item) {
+        EpochPin pin;
+        Node *preds[max_level];
+        Node *succs[max_level];
+        Node *node = nullptr;
+
+        while (true) {
+            if (find(item, preds, succs) != nullptr) {
+                if (node != nullptr) {
+                    delete_node(node); // same semantics as std::set: equivalent keys are not duplicated
+                }
+                return;
+            }
+            if (node == nullptr) {
+                node = new_node(item, random_level());
+                node->refs.store(2, std::memory_order_relaxed); // this insert and the bottom level
+            }
+            for (int i = 0; i < node->level; ++i) {
+                node->next()[i].store(link_to(succs[i]), std::memory_order_relaxed);
+            }
+            uintptr_t expected = link_to(succs[0]);
+            if (preds[0]->next()[0].compare_exchange_strong(expected, link_to(node),
+                                                            std::memory_order_release,
+                                                            std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        count.fetch_add(1, std::memory_order_relaxed);
+
+        link_upper_levels(node, preds, succs);
+        if (marked(node->next()[0].load(std::memory_order_acquire))) {
+            find(item, preds, succs); // erased meanwhile, perhaps after we linked a level it was unlinked from
+        }
+        unref(node);
+    }
+
+    void erase(const iterator &start, const iterator &end) {
+        Node *n = start.node;
+        while (n != end.node) {
+            Node *next = ptr(n->next()[0].load(std::memory_order_acquire));
+            erase(iterator(n));
+            n = next;
+        }
+    }
+
+    void erase(const iterator &it) {
+        Node *n = it.node;
+        for (int i = n->level - 1; i >= 1; --i) {
+            uintptr_t link = n->next()[i].load(std::memory_order_relaxed);
+            while (!marked(link) &&
+                   !n->next()[i].compare_exchange_weak(link, link | 1,
+                                                       std::memory_order_acq_rel,
+                                                       std::memory_order_relaxed)) {
+            }
+        }
+
+        uintptr_t link = n->next()[0].load(std::memory_order_relaxed);
+        while (!marked(link)) {
+            if (n->next()[0].compare_exchange_weak(link, link | 1,
+                                                   std::memory_order_acq_rel,
+                                                   std::memory_order_relaxed)) {
+                count.fetch_sub(1, std::memory_order_relaxed);
+                Node *preds[max_level];
+                Node *succs[max_level];
+                find(n->key, preds, succs); // unlink it now rather than on someone else's path
+                return;
+            }
+        }
+    }
+
+    // Erases elements from the front for as long as pred holds.
+    template<typename Pred>
+    void erase_while_front(Pred pred) {
+        for (iterator it = begin(); it != end() && pred(*it); it = begin()) {
+            erase(it);
+        }
+    }
+
+    iterator begin() {
+        EpochPin pin;
+        return iterator(skip_erased(ptr(head->next()[0].load(std::memory_order_acquire))));
+    }
+
+    iterator end() {
+        return iterator(nullptr);
+    }
+
+    iterator next(const iterator &it) {
+        return std::next(it, 1);
+    }
+
+    uint32_t size() {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    bool contains(const Key &item) {
+        EpochPin pin;
+        Node *preds[max_level];
+        Node *succs[max_level];
+        return find(item, preds, succs) != nullptr;
+    }
+};
+
+#endif // SKIPLIST_HPP
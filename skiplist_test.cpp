@@ -0,0 +1,211 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cassert>
+
+#include "skiplist.hpp"
+#include "order.hpp"
+
+#define NUM_ITEMS 1000
+#define NUM_READERS 10
+#define NUM_WRITERS 10
+
+void int_writer(int id, SkipList<int> &s) {
+    // interleave the writers so they keep racing on neighbouring nodes
+    for (int i = 0; i < NUM_ITEMS; ++i) {
+        s.insert(i * NUM_WRITERS + id);
+    }
+}
+
+void int_reader(SkipList<int> &s, std::atomic<bool> &done) {
+    do {
+        int prev = -1;
+        for (auto it = s.begin(); it != s.end(); it = s.next(it)) {
+            assert(*it > prev);
+            prev = *it;
+        }
+    } while (!done);
+}
+
+void int_check() {
+    SkipList<int> s;
+    std::atomic<bool> done{false};
+    std::vector<std::thread> rt(NUM_READERS);
+    std::vector<std::thread> wt(NUM_WRITERS);
+
+    std::cout << "running reader threads\n";
+    for (int i = 0; i < NUM_READERS; ++i) {
+        rt[i] = std::thread(int_reader, std::ref(s), std::ref(done));
+    }
+
+    std::cout << "running writer threads\n";
+    for (int i = 0; i < NUM_WRITERS; ++i) {
+        wt[i] = std::thread(int_writer, i, std::ref(s));
+    }
+
+    for (auto &t: wt)
+        t.join();
+
+    done = true;
+    for (auto &t: rt)
+        t.join();
+
+    std::cout << " == Final size of SkipList: == " << s.size() << std::endl;
+
+    std::cout << " == Correctness check: == " << std::endl;
+    assert(s.size() == NUM_WRITERS * NUM_ITEMS);
+    int i = 0;
+    for (auto it = s.begin(); it != s.end(); it = s.next(it)) {
+        assert(*it == i++);
+    }
+    assert(i == NUM_WRITERS * NUM_ITEMS);
+
+    // duplicates are ignored, like std::set
+    s.insert(0);
+    assert(s.size() == NUM_WRITERS * NUM_ITEMS);
+    std::cout << "OK" << std::endl;
+}
+
+void erase_check() {
+    SkipList<int> s;
+    std::vector<std::thread> wt(NUM_WRITERS);
+    std::vector<std::thread> et(NUM_WRITERS);
+
+    for (int i = 0; i < NUM_WRITERS; ++i) {
+        wt[i] = std::thread(int_writer, i, std::ref(s));
+    }
+
+    // erase every even key while the writers are still inserting
+    for (int i = 0; i < NUM_WRITERS; ++i) {
+        et[i] = std::thread([&s, i]() {
+            for (int k = 0; k < NUM_ITEMS; ++k) {
+                for (auto it = s.begin(); it != s.end(); it = s.next(it)) {
+                    if (*it % 2 == 0 && *it % NUM_WRITERS == i) {
+                        s.erase(it);
+                    }
+                }
+                if (k % 100 == 0)
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    for (auto &t: wt)
+        t.join();
+    for (auto &t: et)
+        t.join();
+
+    // sweep once more now that every key is in
+    for (auto it = s.begin(); it != s.end(); it = s.next(it)) {
+        if (*it % 2 == 0) {
+            s.erase(it);
+        }
+    }
+
+    std::cout << " == Erase check: == " << std::endl;
+    assert(s.size() == NUM_WRITERS * NUM_ITEMS / 2);
+    int expected = 1;
+    for (auto it = s.begin(); it != s.end(); it = s.next(it)) {
+        assert(*it == expected);
+        expected += 2;
+    }
+    assert(!s.contains(0));
+    assert(s.contains(1));
+
+    // erased keys can be inserted again
+    s.insert(0);
+    assert(s.contains(0));
+    assert(*s.begin() == 0);
+    std::cout << "OK" << std::endl;
+}
+
+void order_writer(int id, SkipList<BookEntry, sell_cmp> &s) {
+    for (int i = 0; i < NUM_ITEMS; ++i) {
+        // few distinct prices so most comparisons fall through to the sequence
+        uint32_t seq = i * NUM_WRITERS + id;
+        s.insert({static_cast<uint32_t>(i % 7), seq, std::make_shared<Order>(i % 7, seq, 1, seq)});
+    }
+}
+
+void order_reader(SkipList<BookEntry, sell_cmp> &s, std::atomic<bool> &done) {
+    sell_cmp cmp;
+    do {
+        const BookEntry *prev = nullptr;
+        for (auto it = s.begin(); it != s.end(); it = s.next(it)) {
+            assert(!prev || cmp(*prev, *it));
+            prev = &*it;
+        }
+    } while (!done);
+}
+
+void order_check() {
+    SkipList<BookEntry, sell_cmp> s;
+    std::atomic<bool> done{false};
+    std::vector<std::thread> rt(NUM_READERS);
+    std::vector<std::thread> wt(NUM_WRITERS);
+
+    for (int i = 0; i < NUM_READERS; ++i) {
+        rt[i] = std::thread(order_reader, std::ref(s), std::ref(done));
+    }
+    for (int i = 0; i < NUM_WRITERS; ++i) {
+        wt[i] = std::thread(order_writer, i, std::ref(s));
+    }
+
+    for (auto &t: wt)
+        t.join();
+
+    done = true;
+    for (auto &t: rt)
+        t.join();
+
+    std::cout << " == Final size of SkipList: == " << s.size() << std::endl;
+    std::cout << " == Correctness check: == " << std::endl;
+    assert(s.size() == NUM_WRITERS * NUM_ITEMS);
+    std::cout << "OK" << std::endl;
+}
+
+// Erased entries must not keep their orders alive for the life of the list.
+void reclaim_check() {
+    SkipList<BookEntry, sell_cmp> s(64);
+    std::vector<std::weak_ptr<Order>> orders;
+    std::vector<std::thread> threads(NUM_WRITERS);
+    std::mutex orders_mutex;
+
+    for (int t = 0; t < NUM_WRITERS; ++t) {
+        threads[t] = std::thread([&, t]() {
+            for (int i = 0; i < NUM_ITEMS * 10; ++i) {
+                uint32_t seq = i * NUM_WRITERS + t;
+                auto order = std::make_shared<Order>(i % 7, seq, 1, seq);
+                {
+                    std::lock_guard<std::mutex> lock(orders_mutex);
+                    orders.push_back(order);
+                }
+                s.insert({static_cast<uint32_t>(i % 7), seq, std::move(order)});
+                s.erase_while_front([](const BookEntry &) { return true; });
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    s.erase_while_front([](const BookEntry &) { return true; });
+
+    size_t alive = 0;
+    for (auto &o: orders) {
+        alive += !o.expired();
+    }
+    std::cout << " == Reclaim check: == " << alive << " of " << orders.size() << " orders alive" << std::endl;
+    assert(s.size() == 0);
+    assert(alive < orders.size() / 10);
+    std::cout << "OK" << std::endl;
+}
+
+int main() {
+    int_check();
+    erase_check();
+    order_check();
+    reclaim_check();
+    return 0;
+}
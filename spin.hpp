@@ -0,0 +1,12 @@
+#ifndef SPIN_HPP
+#define SPIN_HPP
+
+// Tells the CPU we are in a spin-wait loop: on x86 this lets the sibling
+// hyperthread run and avoids the memory order flush when the loop exits.
+inline void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#endif // SPIN_HPP
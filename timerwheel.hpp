@@ -0,0 +1,156 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/*
+ * Hierarchical timing wheel (Varghese & Lauck, as in the Linux timer code):
+ * four levels of 64 slots, each slot of a level spanning a whole turn of
+ * the level below. With millisecond ticks level 0 covers 64 ms and level 3
+ * about 4.6 hours; later deadlines wait in the last level and are placed
+ * again each time it turns.
+ *
+ * schedule() and cancel() are O(1): a timer is a node in the intrusive
+ * list of its slot. advance() moves a higher level slot down a level when
+ * the level below completes a turn, and expires level 0 slots as their
+ * tick passes, so every timer is touched once per level at most.
+ *
+ * Not synchronized; the owner locks around it.
+ */
+template<typename T>
+class TimerWheel {
+public:
+    struct Timer {
+        T value;
+        uint64_t deadline;
+        Timer *prev = nullptr;
+        Timer *next = nullptr;
+        Timer **slot = nullptr;
+    };
+
+    TimerWheel() = default;
+
+    TimerWheel(const TimerWheel &) = delete;
+
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    ~TimerWheel() {
+        for (auto &level: slots) {
+            for (Timer *head: level) {
+                while (head != nullptr) {
+                    Timer *next = head->next;
+                    delete head;
+                    head = next;
+                }
+            }
+        }
+    }
+
+    // Deadlines that already passed expire on the next tick.
+    Timer *schedule(T value, uint64_t deadline) {
+        Timer *timer = new Timer{std::move(value), deadline};
+        place(timer, current + 1);
+        ++count;
+        return timer;
+    }
+
+    void cancel(Timer *timer) {
+        unlink(timer);
+        --count;
+        delete timer;
+    }
+
+    // Runs the ticks up to now and calls expire(value) for every timer
+    // that came due, in deadline order between ticks.
+    template<typename F>
+    void advance(uint64_t now, F expire) {
+        if (count == 0) {
+            current = std::max(current, now); // nothing to cascade on the way
+            return;
+        }
+        while (current < now) {
+            ++current;
+            for (unsigned level = 1; level < levels; ++level) {
+                if ((current & ((uint64_t{1} << (level * slot_bits)) - 1)) != 0) {
+                    break;
+                }
+                Timer *head = std::exchange(slots[level][index(current, level)], nullptr);
+                while (head != nullptr) {
+                    Timer *next = head->next;
+                    place(head, current); // due now still makes this tick's level 0 slot
+                    head = next;
+                }
+            }
+
+            Timer *head = std::exchange(slots[0][index(current, 0)], nullptr);
+            while (head != nullptr) {
+                Timer *next = head->next;
+                --count;
+                expire(std::move(head->value));
+                delete head;
+                head = next;
+            }
+        }
+    }
+
+    // The last tick advance() ran.
+    uint64_t now() const {
+        return current;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+private:
+    static constexpr unsigned levels = 4;
+    static constexpr unsigned slot_bits = 6;
+    static constexpr uint64_t slots_per_level = uint64_t{1} << slot_bits;
+
+    Timer *slots[levels][slots_per_level] = {};
+    uint64_t current = 0;
+    size_t count = 0;
+
+    static size_t index(uint64_t tick, unsigned level) {
+        return (tick >> (level * slot_bits)) & (slots_per_level - 1);
+    }
+
+    // The lowest level whose turn still reaches the deadline, which is
+    // moved up to earliest if it passed.
+    void place(Timer *timer, uint64_t earliest) {
+        uint64_t deadline = std::max(timer->deadline, earliest);
+        uint64_t delta = deadline - current;
+        unsigned level = 0;
+        while (level + 1 < levels && delta >= uint64_t{1} << ((level + 1) * slot_bits)) {
+            ++level;
+        }
+        if (delta >= uint64_t{1} << (levels * slot_bits)) {
+            deadline = current + (uint64_t{1} << (levels * slot_bits)) - 1; // placed again when the wheel turns
+        }
+
+        Timer **slot = &slots[level][index(deadline, level)];
+        timer->slot = slot;
+        timer->prev = nullptr;
+        timer->next = *slot;
+        if (*slot != nullptr) {
+            (*slot)->prev = timer;
+        }
+        *slot = timer;
+    }
+
+    void unlink(Timer *timer) {
+        if (timer->prev != nullptr) {
+            timer->prev->next = timer->next;
+        } else {
+            *timer->slot = timer->next;
+        }
+        if (timer->next != nullptr) {
+            timer->next->prev = timer->prev;
+        }
+    }
+};
+
+#endif // TIMERWHEEL_HPP
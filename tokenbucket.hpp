@@ -0,0 +1,57 @@
+#ifndef TOKENBUCKET_HPP
+#define TOKENBUCKET_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Token bucket: rate tokens a second, at most burst of them saved up, and
+ * a full bucket to start with. Credit is kept in token-nanoseconds, one
+ * token being worth a billion, so refilling is integer arithmetic.
+ *
+ * Not synchronized; a session's bucket is only used by whoever runs it.
+ */
+class TokenBucket {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    TokenBucket(uint32_t rate, uint32_t burst)
+            : rate{rate}, capacity{static_cast<uint64_t>(std::max(burst, 1u)) * token},
+              credit{capacity}, refilled{Clock::now()} {}
+
+    // Whole tokens in the bucket, at most n.
+    uint32_t available(uint32_t n, Clock::time_point now) {
+        refill(now);
+        return static_cast<uint32_t>(std::min<uint64_t>(n, credit / token));
+    }
+
+    // Spends n tokens that available() reported.
+    void take(uint32_t n) {
+        credit -= std::min<uint64_t>(n, credit / token) * token;
+    }
+
+    // How long until there are n tokens, or a full bucket if it holds fewer.
+    Clock::duration wait(uint32_t n) const {
+        uint64_t wanted = std::min(capacity, std::max<uint64_t>(n, 1) * token);
+        return std::chrono::nanoseconds(wanted > credit ? (wanted - credit + rate - 1) / rate : 0);
+    }
+
+private:
+    static constexpr uint64_t token = 1'000'000'000;
+
+    const uint64_t rate;
+    const uint64_t capacity;
+    uint64_t credit;
+    Clock::time_point refilled;
+
+    void refill(Clock::time_point now) {
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - refilled).count();
+        refilled = now;
+        // capped first, so that a long idle time cannot overflow the product
+        elapsed = std::min(elapsed, capacity / rate + 1);
+        credit = std::min(capacity, credit + elapsed * rate);
+    }
+};
+
+#endif // TOKENBUCKET_HPP
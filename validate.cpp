@@ -0,0 +1,389 @@
+// Checks an engine output stream for lost, duplicated or reordered lines.
+//
+// With --sequenced output every line must carry the next global number and
+// the next number of its symbol's stream. Independently of that, the lines
+// must describe a possible history of every order: it is added once, only
+// executed while open, never beyond its quantity, with execution ids
+// counting up, and cancelled at most once. An iceberg is added again with
+// its next slice right after the execution that used up the last one. An
+// execution between two added orders is an auction's, at a price between
+// both limits. A self-trade decrement lowers an open resting order like an
+// execution, without using an execution id, and closes it for good at zero.
+// Unsequenced output gets the second check only.
+
+#include <getopt.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct OrderState {
+    uint32_t price = 0;
+    uint32_t remaining = 0;
+    uint32_t next_execution = 1;
+    bool open = false;
+    bool is_sell = false;
+};
+
+class Validator {
+private:
+    uint64_t line_no = 0;
+    uint64_t global = 0;
+    bool sequenced = false;
+    std::unordered_map<std::string, uint64_t> streams;
+    std::unordered_map<uint32_t, OrderState> orders;
+    uint64_t violations = 0;
+
+    // the resting order the last execution line filled, which may show its
+    // next slice until a line other than an execution or summary comes
+    bool replenishable = false;
+    uint32_t last_filled = 0;
+    const uint64_t max_reported;
+
+    // the line being checked, split in place
+    char *current = nullptr;
+    char *current_end = nullptr;
+
+    void violation(const char *what) {
+        if (++violations > max_reported) {
+            return;
+        }
+        std::string line(current, current_end);
+        for (char &c: line) {
+            if (c == '\0') {
+                c = ' ';
+            }
+        }
+        fprintf(stderr, "line %llu: %s: %s\n", static_cast<unsigned long long>(line_no), what, line.c_str());
+    }
+
+    // Splits the line in place; returns the number of fields.
+    static size_t split(char *line, char **fields, size_t max_fields) {
+        size_t n = 0;
+        char *p = line;
+        while (n < max_fields) {
+            while (*p == ' ') {
+                ++p;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            fields[n++] = p;
+            while (*p != ' ' && *p != '\0') {
+                ++p;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            *p++ = '\0';
+        }
+        return n;
+    }
+
+    static uint64_t number(const char *field) {
+        return strtoull(field, nullptr, 10);
+    }
+
+    void check_sequence(char **fields) {
+        uint64_t g = number(fields[0]);
+        if (g != global + 1) {
+            violation(g <= global ? "global sequence went back" : "global sequence gap");
+        }
+        global = g;
+
+        uint64_t &last = streams[fields[1]];
+        uint64_t s = number(fields[2]);
+        if (s != last + 1) {
+            violation(s <= last ? "symbol sequence went back" : "symbol sequence gap");
+        }
+        last = s;
+    }
+
+    void check_added(char **fields, size_t n) {
+        if (n < 6) {
+            violation("short line");
+            return;
+        }
+        const uint32_t id = static_cast<uint32_t>(number(fields[1]));
+        const uint32_t price = static_cast<uint32_t>(number(fields[3]));
+        const bool is_sell = fields[0][0] == 'S';
+        auto [it, inserted] = orders.try_emplace(id);
+        if (inserted) {
+            it->second = {price, static_cast<uint32_t>(number(fields[4])), 1, true, is_sell};
+        } else if (replenishable && id == last_filled && it->second.price == price && it->second.is_sell == is_sell) {
+            it->second.remaining = static_cast<uint32_t>(number(fields[4]));
+            it->second.open = true;
+            ++it->second.next_execution;
+        } else {
+            violation("order added twice");
+        }
+        if (it->second.remaining == 0) {
+            violation("order added without quantity");
+        }
+    }
+
+    void check_executed(char **fields, size_t n) {
+        replenishable = false;
+        if (n < 7) {
+            violation("short line");
+            return;
+        }
+        auto it = orders.find(static_cast<uint32_t>(number(fields[1])));
+        if (it == orders.end() || !it->second.open) {
+            violation(it == orders.end() ? "execution before the resting order was added"
+                                         : "execution against a closed order");
+            return;
+        }
+        OrderState &o = it->second;
+        last_filled = it->first;
+        auto other = orders.find(static_cast<uint32_t>(number(fields[2])));
+        if (other != orders.end() && other->second.open) {
+            check_auction_execution(o, other->second, fields);
+            return;
+        }
+        if (other != orders.end()) {
+            violation("execution reported after the incoming order was added");
+        }
+        if (number(fields[3]) != o.next_execution) {
+            violation("execution id out of order");
+        }
+        if (number(fields[4]) != o.price) {
+            violation("execution away from the resting price");
+        }
+        fill(o, static_cast<uint32_t>(number(fields[5])));
+    }
+
+    // An auction executes two resting orders at one price between their limits.
+    void check_auction_execution(OrderState &resting, OrderState &other, char **fields) {
+        if (resting.is_sell == other.is_sell) {
+            violation("auction execution between orders of the same side");
+        }
+        uint32_t price = static_cast<uint32_t>(number(fields[4]));
+        const OrderState &buy = resting.is_sell ? other : resting;
+        const OrderState &sell = resting.is_sell ? resting : other;
+        if (price > buy.price || price < sell.price) {
+            violation("auction execution outside the limits");
+        }
+        if (number(fields[3]) != resting.next_execution) {
+            violation("execution id out of order");
+        }
+        uint32_t count = static_cast<uint32_t>(number(fields[5]));
+        fill(other, count, false);
+        fill(resting, count);
+    }
+
+    // Only the order reported first has its execution id in the line.
+    void fill(OrderState &o, uint32_t count, bool reported = true) {
+        if (count == 0 || count > o.remaining) {
+            violation("execution quantity out of range");
+            count = o.remaining;
+        }
+        o.remaining -= count;
+        if (o.remaining == 0) {
+            o.open = false;
+            replenishable = reported;
+        } else if (reported) {
+            ++o.next_execution;
+        }
+    }
+
+    void check_deleted(char **fields, size_t n) {
+        if (n < 4) {
+            violation("short line");
+            return;
+        }
+        auto it = orders.find(static_cast<uint32_t>(number(fields[1])));
+        bool accepted = fields[2][0] == 'A';
+        if (accepted) {
+            if (it == orders.end() || !it->second.open) {
+                violation(it == orders.end() ? "cancel accepted for an order never added"
+                                             : "cancel accepted for a closed order");
+            } else {
+                it->second.open = false;
+            }
+        } else if (it != orders.end() && it->second.open) {
+            violation("cancel rejected for an open order");
+        }
+    }
+
+    // 'D <resting id> <incoming id> <count> <time>'
+    void check_decremented(char **fields, size_t n) {
+        if (n < 5) {
+            violation("short line");
+            return;
+        }
+        auto it = orders.find(static_cast<uint32_t>(number(fields[1])));
+        if (it == orders.end() || !it->second.open) {
+            violation(it == orders.end() ? "decrement before the resting order was added"
+                                         : "decrement of a closed order");
+            return;
+        }
+        if (orders.count(static_cast<uint32_t>(number(fields[2]))) != 0) {
+            violation("decrement reported after the incoming order was added");
+        }
+        OrderState &o = it->second;
+        uint32_t count = static_cast<uint32_t>(number(fields[3]));
+        if (count == 0 || count > o.remaining) {
+            violation("decrement quantity out of range");
+            count = o.remaining;
+        }
+        o.remaining -= count;
+        o.open = o.remaining != 0;
+    }
+
+    // limit rejects come before the order could rest or trade
+    void check_rejected(char **fields, size_t n) {
+        if (n < 3) {
+            violation("short line");
+            return;
+        }
+        if (orders.count(static_cast<uint32_t>(number(fields[1]))) != 0) {
+            violation("order rejected after it was added");
+        }
+    }
+
+public:
+    explicit Validator(uint64_t max_reported) : max_reported{max_reported} {}
+
+    void check(char *line) {
+        ++line_no;
+        current = line;
+        current_end = line + strlen(line);
+
+        char *fields[12];
+        size_t n = split(line, fields, 12);
+        if (n == 0) {
+            return;
+        }
+
+        if (line_no == 1) {
+            sequenced = fields[0][0] >= '0' && fields[0][0] <= '9';
+        }
+        if (sequenced) {
+            if (n < 4) {
+                violation("short line");
+                return;
+            }
+            check_sequence(fields);
+            n -= 3;
+            std::memmove(fields, fields + 3, n * sizeof(char *));
+        }
+
+        switch (fields[0][0]) {
+            case 'B':
+            case 'S':
+                check_added(fields, n);
+                break;
+            case 'E':
+                check_executed(fields, n);
+                break;
+            case 'X':
+                check_deleted(fields, n);
+                break;
+            case 'R':
+                check_rejected(fields, n);
+                break;
+            case 'D':
+                check_decremented(fields, n);
+                break;
+            case 'L':
+                break;
+            default:
+                violation("unknown line");
+                break;
+        }
+        if (fields[0][0] != 'E' && fields[0][0] != 'L') {
+            replenishable = false;
+        }
+    }
+
+    uint64_t lines() const { return line_no; }
+
+    uint64_t errors() const { return violations; }
+
+    size_t stream_count() const { return streams.size(); }
+};
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [--max-reported=<n>] [<engine output>]\n"
+            "  --max-reported=<n>  print at most n violations (default 20), all are counted\n",
+            argv0);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t max_reported = 20;
+
+    static const struct option long_options[] = {
+            {"max-reported", required_argument, nullptr, 'm'},
+            {nullptr, 0,                        nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'm':
+                max_reported = strtoull(optarg, nullptr, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    const char *path = optind < argc ? argv[optind] : nullptr;
+
+    FILE *in = stdin;
+    if (path != nullptr && strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (in == nullptr) {
+            perror(path);
+            return 2;
+        }
+    }
+
+    Validator validator(max_reported);
+
+    // read in large blocks and cut lines out of the buffer ourselves
+    std::vector<char> buffer(1 << 20);
+    size_t filled = 0;
+    while (true) {
+        size_t n = fread(buffer.data() + filled, 1, buffer.size() - filled - 1, in);
+        filled += n;
+        if (n == 0 && filled == 0) {
+            break;
+        }
+
+        char *start = buffer.data();
+        char *end = start + filled;
+        char *newline;
+        while ((newline = static_cast<char *>(memchr(start, '\n', end - start))) != nullptr) {
+            *newline = '\0';
+            validator.check(start);
+            start = newline + 1;
+        }
+
+        filled = end - start;
+        if (n == 0) {
+            start[filled] = '\0'; // last line without a newline
+            validator.check(start);
+            break;
+        }
+        std::memmove(buffer.data(), start, filled);
+        if (filled == buffer.size() - 1) {
+            buffer.resize(buffer.size() * 2);
+        }
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    fprintf(stderr, "%llu lines, %zu symbol streams, %llu violations\n",
+            static_cast<unsigned long long>(validator.lines()), validator.stream_count(),
+            static_cast<unsigned long long>(validator.errors()));
+    return validator.errors() == 0 ? 0 : 1;
+}